@@ -13,8 +13,10 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <locale.h>
+#include <poll.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 /* suck up the non-standard openpty/forkpty */
 #if defined(__FreeBSD__)
@@ -30,6 +32,7 @@
 #endif
 
 #include <gtk/gtk.h>
+#include <glib-unix.h>
 
 #include "pangoterm.h"
 
@@ -45,6 +48,15 @@ CONF_INT(cols,  0, 80, "Number of columns", "NUM");
 
 CONF_STRING(term, 0, "xterm", "Terminal type", "STR");
 
+CONF_BOOL(stats, 0, FALSE, "Print performance counters on exit");
+
+CONF_STRING(record, 0, "", "Record output from the child and resizes, with timings, to a file", "FILE");
+CONF_STRING(replay, 0, "", "Replay a recorded session instead of running a child", "FILE");
+CONF_BOOL(replay_fast, 0, FALSE, "Replay as fast as possible rather than in real time");
+
+CONF_STRING(bench, 0, "", "Render a captured byte stream without a display and print timings", "FILE");
+CONF_INT(bench_fps, 0, 60, "Frame rate to render at when benchmarking; 0 for every chunk", "NUM");
+
 static char *alt_fonts[] = {
   "Courier 10 Pitch",
   NULL
@@ -52,41 +64,273 @@ static char *alt_fonts[] = {
 
 static int master;
 
+/* Output from the child is read by a dedicated thread into this single
+ * producer, single consumer ring, so a flood of output cannot starve the
+ * main loop. head and tail are free-running byte counts; only the reader
+ * advances head and only the main thread advances tail. When the ring is
+ * full the reader stops reading, so the kernel throttles the child.
+ */
+#define READ_RING_SIZE (1024*1024)
+
+static struct {
+  char buffer[READ_RING_SIZE];
+  volatile gint head;
+  volatile gint tail;
+  volatile gint main_notified;  /* a wakeup is pending on wake_main */
+  volatile gint reader_waiting; /* reader is blocked on wake_reader */
+  volatile gint eof;
+  int wake_main[2];
+  int wake_reader[2];
+} readring;
+
+/* Only the reader thread updates these, except wakeups */
+static struct {
+  guint64 polls;
+  guint64 reads;
+  guint64 bytes;
+  guint64 wakeups;
+} readstats;
+
+/* Bytes for the child are queued here and written as the PTY accepts them,
+ * so nothing is lost or blocks when the child is slow to read. Each
+ * write_master() call is recorded with its end offset and queue time, for
+ * the latency counters.
+ */
+static struct {
+  GByteArray *bytes;
+  guint start;
+  GArray *marks;
+  guint watch_id;
+} writequeue;
+
+typedef struct {
+  guint end;
+  gint64 queued_time;
+} WriteMark;
+
+static struct {
+  guint64 bytes;
+  guint64 writes;
+  guint64 deferred;
+  guint64 max_queued;
+  guint64 latency_count;
+  gint64 latency_total;
+  gint64 latency_max;
+} writestats;
+
+static gboolean master_writable(gint fd, GIOCondition cond, gpointer user_data);
+
+static void flush_writequeue(void)
+{
+  while(writequeue.start < writequeue.bytes->len) {
+    ssize_t written = write(master,
+        writequeue.bytes->data + writequeue.start,
+        writequeue.bytes->len - writequeue.start);
+
+    if(written == -1 && errno == EINTR)
+      continue;
+    if(written == -1 && errno == EAGAIN)
+      break;
+    if(written < 0) {
+      /* Child has gone away; nobody will read this */
+      writequeue.start = writequeue.bytes->len;
+      break;
+    }
+
+    writestats.writes++;
+    writestats.bytes += written;
+    writequeue.start += written;
+  }
+
+  gint64 now = g_get_monotonic_time();
+  guint done_marks = 0;
+  while(done_marks < writequeue.marks->len) {
+    WriteMark *mark = &g_array_index(writequeue.marks, WriteMark, done_marks);
+    if(mark->end > writequeue.start)
+      break;
+
+    gint64 latency = now - mark->queued_time;
+    writestats.latency_count++;
+    writestats.latency_total += latency;
+    if(latency > writestats.latency_max)
+      writestats.latency_max = latency;
+
+    done_marks++;
+  }
+  g_array_remove_range(writequeue.marks, 0, done_marks);
+
+  if(writequeue.start == writequeue.bytes->len) {
+    g_byte_array_set_size(writequeue.bytes, 0);
+    writequeue.start = 0;
+  }
+  else if(writequeue.start > writequeue.bytes->len / 2) {
+    /* Compact once the sent prefix dominates */
+    guint start = writequeue.start;
+    g_byte_array_remove_range(writequeue.bytes, 0, start);
+    for(guint i = 0; i < writequeue.marks->len; i++)
+      g_array_index(writequeue.marks, WriteMark, i).end -= start;
+    writequeue.start = 0;
+  }
+
+  if(writequeue.bytes->len && !writequeue.watch_id) {
+    writestats.deferred++;
+    writequeue.watch_id = g_unix_fd_add(master, G_IO_OUT, master_writable, NULL);
+  }
+}
+
+static gboolean master_writable(gint fd, GIOCondition cond, gpointer user_data)
+{
+  flush_writequeue();
+
+  if(writequeue.bytes->len)
+    return TRUE;
+
+  writequeue.watch_id = 0;
+  return FALSE;
+}
+
 static size_t write_master(const char *bytes, size_t len, void *user)
 {
-  return write(master, bytes, len);
+  g_byte_array_append(writequeue.bytes, (const guint8 *)bytes, len);
+
+  WriteMark mark = {
+    .end = writequeue.bytes->len,
+    .queued_time = g_get_monotonic_time(),
+  };
+  g_array_append_val(writequeue.marks, mark);
+
+  if(writequeue.bytes->len - writequeue.start > writestats.max_queued)
+    writestats.max_queued = writequeue.bytes->len - writequeue.start;
+
+  /* If the watch is pending the PTY is full; let it drain in order */
+  if(!writequeue.watch_id)
+    flush_writequeue();
+
+  return len;
+}
+
+/* A recording starts with RECORD_MAGIC, followed by events. Each is a type
+ * byte, the microseconds since the previous event as a varint, then
+ *   'd': a varint length and that many bytes of output
+ *   'r': the new size as varints rows then cols
+ */
+#define RECORD_MAGIC "pangoterm-record 1\n"
+
+static struct {
+  FILE *file;
+  gint64 last_time;
+} recorder;
+
+static void record_varint(guint64 val)
+{
+  do {
+    guint8 byte = val & 0x7f;
+    val >>= 7;
+    putc(val ? byte | 0x80 : byte, recorder.file);
+  } while(val);
+}
+
+static void record_event(char type)
+{
+  gint64 now = g_get_monotonic_time();
+
+  putc(type, recorder.file);
+  record_varint(now - recorder.last_time);
+  recorder.last_time = now;
+}
+
+static void record_bytes(const char *bytes, size_t len)
+{
+  if(!recorder.file)
+    return;
+
+  record_event('d');
+  record_varint(len);
+  fwrite(bytes, len, 1, recorder.file);
+}
+
+static void record_resize(int rows, int cols)
+{
+  if(!recorder.file)
+    return;
+
+  record_event('r');
+  record_varint(rows);
+  record_varint(cols);
 }
 
 static void resized(int rows, int cols, void *user)
 {
   struct winsize size = { rows, cols, 0, 0 };
   ioctl(master, TIOCSWINSZ, &size);
+
+  record_resize(rows, cols);
 }
 
-static gboolean master_readable(GIOChannel *source, GIOCondition cond, gpointer user_data)
+static void wake_fd(int fd)
 {
-  PangoTerm *pt = user_data;
-
-  pangoterm_begin_update(pt);
+  char c = 0;
+  while(write(fd, &c, 1) == -1 && errno == EINTR)
+    ;
+}
 
-  /* Make sure we don't take longer than 20msec doing this */
-  guint64 deadline_time = g_get_real_time() + 20*1000;
+static void reader_notify_main(void)
+{
+  if(g_atomic_int_compare_and_exchange(&readring.main_notified, 0, 1))
+    wake_fd(readring.wake_main[1]);
+}
 
+static gpointer reader_thread(gpointer data)
+{
   while(1) {
-    /* Linux kernel's PTY buffer is a fixed 4096 bytes (1 page) so there's
-     * never any point read()ing more than that
+    guint head = g_atomic_int_get(&readring.head);
+    guint tail = g_atomic_int_get(&readring.tail);
+    guint space = READ_RING_SIZE - (head - tail);
+
+    if(!space) {
+      g_atomic_int_set(&readring.reader_waiting, 1);
+
+      /* Recheck in case the main thread drained it before seeing the flag */
+      if(g_atomic_int_get(&readring.tail) == (gint)tail) {
+        char c;
+        while(read(readring.wake_reader[0], &c, 1) == -1 && errno == EINTR)
+          ;
+      }
+
+      g_atomic_int_set(&readring.reader_waiting, 0);
+      continue;
+    }
+
+    struct pollfd pfd = { .fd = master, .events = POLLIN };
+    if(poll(&pfd, 1, -1) == -1) {
+      if(errno == EINTR)
+        continue;
+      fprintf(stderr, "poll(master) failed - %s\n", strerror(errno));
+      exit(1);
+    }
+    readstats.polls++;
+
+    /* Modern kernels buffer far more than a page per PTY, so ask for all
+     * the free space in the ring at once; the second iovec covers the part
+     * that wraps around. A single readv() then normally drains everything
+     * that is available, without a trailing EAGAIN read.
      */
-    char buffer[4096];
+    guint offs = head % READ_RING_SIZE;
+    size_t len = MIN(space, READ_RING_SIZE - offs);
+    struct iovec iov[2] = {
+      { .iov_base = readring.buffer + offs, .iov_len = len },
+      { .iov_base = readring.buffer,        .iov_len = space - len },
+    };
 
-    ssize_t bytes = read(master, buffer, sizeof buffer);
+    ssize_t bytes = readv(master, iov, iov[1].iov_len ? 2 : 1);
 
-    if(bytes == -1 && errno == EAGAIN)
-      break;
+    if(bytes == -1 && (errno == EAGAIN || errno == EINTR))
+      continue;
 
     if(bytes == 0 || (bytes == -1 && errno == EIO)) {
-      // TODO
-      // gtk_main_quit();
-      return FALSE;
+      g_atomic_int_set(&readring.eof, 1);
+      reader_notify_main();
+      return NULL;
     }
     if(bytes < 0) {
       fprintf(stderr, "read(master) failed - %s\n", strerror(errno));
@@ -97,7 +341,7 @@ static gboolean master_readable(GIOChannel *source, GIOCondition cond, gpointer
     printf("Read %zd bytes from master:\n", bytes);
     int i;
     for(i = 0; i < bytes; i++) {
-      printf(i % 16 == 0 ? " |  %02x" : " %02x", buffer[i]);
+      printf(i % 16 == 0 ? " |  %02x" : " %02x", readring.buffer[(offs + i) % READ_RING_SIZE]);
       if(i % 16 == 15)
         printf("\n");
     }
@@ -105,7 +349,49 @@ static gboolean master_readable(GIOChannel *source, GIOCondition cond, gpointer
       printf("\n");
 #endif
 
-    pangoterm_push_bytes(pt, buffer, bytes);
+    readstats.reads++;
+    readstats.bytes += bytes;
+
+    g_atomic_int_set(&readring.head, head + bytes);
+    reader_notify_main();
+  }
+}
+
+static gboolean master_readable(gint fd, GIOCondition cond, gpointer user_data)
+{
+  PangoTerm *pt = user_data;
+
+  /* Drain before clearing the flag, so a wakeup for data published after
+   * this point can't be eaten here. The ring is read below either way */
+  char drain[64];
+  while(read(readring.wake_main[0], drain, sizeof drain) > 0)
+    ;
+  g_atomic_int_set(&readring.main_notified, 0);
+
+  readstats.wakeups++;
+
+  pangoterm_begin_update(pt);
+
+  /* Make sure we don't take longer than 20msec doing this */
+  guint64 deadline_time = g_get_real_time() + 20*1000;
+
+  guint head, tail;
+  while(1) {
+    head = g_atomic_int_get(&readring.head);
+    tail = readring.tail;
+
+    if(head == tail)
+      break;
+
+    guint offs = tail % READ_RING_SIZE;
+    size_t len = MIN(head - tail, READ_RING_SIZE - offs);
+
+    pangoterm_push_bytes(pt, readring.buffer + offs, len);
+    record_bytes(readring.buffer + offs, len);
+
+    g_atomic_int_set(&readring.tail, tail + len);
+    if(g_atomic_int_get(&readring.reader_waiting))
+      wake_fd(readring.wake_reader[1]);
 
     if(g_get_real_time() >= deadline_time)
       break;
@@ -113,32 +399,199 @@ static gboolean master_readable(GIOChannel *source, GIOCondition cond, gpointer
 
   pangoterm_end_update(pt);
 
+  if(g_atomic_int_get(&readring.head) != (gint)readring.tail) {
+    /* Ran out of time; come back for the rest after other events */
+    reader_notify_main();
+    return TRUE;
+  }
+
+  if(g_atomic_int_get(&readring.eof)) {
+    // TODO
+    // gtk_main_quit();
+    return FALSE;
+  }
+
   return TRUE;
 }
 
-int main(int argc, char *argv[])
+typedef struct {
+  char type;
+  gint64 delay;
+  const char *bytes;
+  gsize len;
+  int rows, cols;
+} RecordEvent;
+
+typedef struct {
+  const guint8 *data;
+  gsize len;
+  gsize offs;
+} RecordReader;
+
+static gboolean record_read_varint(RecordReader *reader, guint64 *val)
 {
-  VTERM_CHECK_VERSION;
+  *val = 0;
+  for(int shift = 0; shift < 64; shift += 7) {
+    if(reader->offs >= reader->len)
+      return FALSE;
 
-  // setenv("GDK_BACKEND", "x11", TRUE);
-  if(!conf_parse(&argc, &argv))
-    exit(1);
+    guint8 byte = reader->data[reader->offs++];
+    *val |= (guint64)(byte & 0x7f) << shift;
+    if(!(byte & 0x80))
+      return TRUE;
+  }
 
-  // GLib has consumed the options, but it might leave a -- in place in argv[1]
-  if(argc > 1 && strcmp(argv[1], "--") == 0) {
-    argv++;
-    argc--;
+  return FALSE;
+}
+
+/* Returns FALSE at the end of the recording, or if it's truncated */
+static gboolean record_read_event(RecordReader *reader, RecordEvent *ev)
+{
+  if(reader->offs >= reader->len)
+    return FALSE;
+
+  ev->type = reader->data[reader->offs++];
+
+  guint64 delay;
+  if(!record_read_varint(reader, &delay))
+    return FALSE;
+  ev->delay = delay;
+
+  guint64 a, b;
+  switch(ev->type) {
+  case 'd':
+    if(!record_read_varint(reader, &a) || a > reader->len - reader->offs)
+      return FALSE;
+    ev->bytes = (const char *)reader->data + reader->offs;
+    ev->len = a;
+    reader->offs += a;
+    return TRUE;
+
+  case 'r':
+    if(!record_read_varint(reader, &a) || !record_read_varint(reader, &b))
+      return FALSE;
+    if(!a || !b || a > G_MAXINT || b > G_MAXINT)
+      return FALSE;
+    ev->rows = a;
+    ev->cols = b;
+    return TRUE;
+
+  default:
+    return FALSE;
   }
+}
 
-  gtk_init();
-  setlocale(LC_CTYPE, NULL);
+/* Sets up reader over contents if it's a recording, or returns FALSE if it's
+ * just a byte stream */
+static gboolean record_open(RecordReader *reader, const gchar *contents, gsize len)
+{
+  if(len < strlen(RECORD_MAGIC) || memcmp(contents, RECORD_MAGIC, strlen(RECORD_MAGIC)) != 0)
+    return FALSE;
 
-  PangoTerm *pt = pangoterm_new(CONF_lines, CONF_cols);
+  reader->data = (const guint8 *)contents;
+  reader->len  = len;
+  reader->offs = strlen(RECORD_MAGIC);
+  return TRUE;
+}
 
-  pangoterm_set_fonts(pt, CONF_font, CONF_font_italic, alt_fonts);
+static size_t write_discard(const char *bytes, size_t len, void *user)
+{
+  return len;
+}
 
-  pangoterm_set_title(pt, CONF_title);
+static struct {
+  gchar *contents;
+  RecordReader reader;
+  RecordEvent event;
+  gboolean have_event;
+  /* When the pending event is due */
+  gint64 event_time;
+  gint64 start_time;
+  guint64 bytes;
+} replay;
+
+static gboolean replay_step(gpointer user_data);
+
+static void replay_advance(void)
+{
+  replay.have_event = record_read_event(&replay.reader, &replay.event);
+  if(replay.have_event)
+    replay.event_time += replay.event.delay;
+}
+
+static void replay_schedule(PangoTerm *pt)
+{
+  if(CONF_replay_fast) {
+    /* Idle priority lets frames be drawn in between */
+    g_idle_add(replay_step, pt);
+    return;
+  }
+
+  gint64 wait = replay.event_time - g_get_monotonic_time();
+  g_timeout_add(wait > 0 ? wait / 1000 : 0, replay_step, pt);
+}
+
+static gboolean replay_step(gpointer user_data)
+{
+  PangoTerm *pt = user_data;
+
+  pangoterm_begin_update(pt);
+
+  /* Same limit as master_readable() */
+  gint64 deadline_time = g_get_monotonic_time() + 20*1000;
+
+  while(replay.have_event) {
+    gint64 now = g_get_monotonic_time();
+    if(now >= deadline_time ||
+       (!CONF_replay_fast && replay.event_time > now))
+      break;
+
+    if(replay.event.type == 'd') {
+      pangoterm_push_bytes(pt, replay.event.bytes, replay.event.len);
+      replay.bytes += replay.event.len;
+    }
+    else
+      pangoterm_set_size(pt, replay.event.rows, replay.event.cols);
+
+    replay_advance();
+  }
+
+  pangoterm_end_update(pt);
+
+  if(replay.have_event)
+    replay_schedule(pt);
+  else
+    fprintf(stderr, "replay: %" G_GUINT64_FORMAT " bytes in %.3f sec\n",
+        replay.bytes, (g_get_monotonic_time() - replay.start_time) / (double)G_USEC_PER_SEC);
 
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean replay_start(PangoTerm *pt, const char *path)
+{
+  gsize len;
+  GError *error = NULL;
+
+  if(!g_file_get_contents(path, &replay.contents, &len, &error)) {
+    fprintf(stderr, "Cannot read %s - %s\n", path, error->message);
+    g_error_free(error);
+    return FALSE;
+  }
+
+  if(!record_open(&replay.reader, replay.contents, len)) {
+    fprintf(stderr, "Cannot replay %s - not a recording\n", path);
+    return FALSE;
+  }
+
+  replay.start_time = replay.event_time = g_get_monotonic_time();
+  replay_advance();
+  replay_schedule(pt);
+
+  return TRUE;
+}
+
+static void spawn_child(PangoTerm *pt, int argc, char *argv[])
+{
   /* None of the docs about termios explain how to construct a new one of
    * these, so this is largely a guess */
   struct termios termios = {
@@ -245,19 +698,191 @@ int main(int argc, char *argv[])
   close(stderr_save_fileno);
   fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
 
-  GIOChannel *gio_master = g_io_channel_unix_new(master);
-  g_io_add_watch(gio_master, G_IO_IN|G_IO_HUP, master_readable, pt);
+  if(!g_unix_open_pipe(readring.wake_main, FD_CLOEXEC, NULL) ||
+     !g_unix_open_pipe(readring.wake_reader, FD_CLOEXEC, NULL)) {
+    fprintf(stderr, "Cannot create pipe - %s\n", strerror(errno));
+    exit(1);
+  }
+  g_unix_set_fd_nonblocking(readring.wake_main[0], TRUE, NULL);
+  /* A full pipe already wakes the reader; the main thread mustn't block on it */
+  g_unix_set_fd_nonblocking(readring.wake_reader[1], TRUE, NULL);
+
+  g_unix_fd_add(readring.wake_main[0], G_IO_IN, master_readable, pt);
+  g_thread_unref(g_thread_new("pty-reader", reader_thread, NULL));
+
+  writequeue.bytes = g_byte_array_new();
+  writequeue.marks = g_array_new(FALSE, FALSE, sizeof(WriteMark));
 
   pangoterm_set_write_fn(pt, &write_master, NULL);
   pangoterm_set_resized_fn(pt, &resized, NULL);
+}
+
+/* Bytes handed to pangoterm_push_bytes() at once when benchmarking, about what
+ * master_readable() sees from one wakeup under a flood */
+#define BENCH_CHUNK 65536
+
+static struct {
+  gint64 frame_interval;
+  gint64 next_frame;
+} bench;
+
+static void bench_push(PangoTerm *pt, const char *bytes, gsize len)
+{
+  for(gsize offs = 0; offs < len; offs += BENCH_CHUNK) {
+    gsize chunk = MIN(len - offs, BENCH_CHUNK);
+
+    pangoterm_begin_update(pt);
+    pangoterm_push_bytes(pt, bytes + offs, chunk);
+    pangoterm_end_update(pt);
+
+    /* Render as a frame clock would; at most once per interval however much
+     * input arrived in the meantime */
+    gint64 now = g_get_monotonic_time();
+    if(now >= bench.next_frame && pangoterm_frame_pending(pt)) {
+      pangoterm_render_frame(pt);
+      bench.next_frame = now + bench.frame_interval;
+    }
+  }
+}
+
+static int run_bench(const char *path)
+{
+  gchar *bytes;
+  gsize len;
+  GError *error = NULL;
+
+  if(!g_file_get_contents(path, &bytes, &len, &error)) {
+    fprintf(stderr, "Cannot read %s - %s\n", path, error->message);
+    g_error_free(error);
+    return 1;
+  }
+
+  PangoTerm *pt = pangoterm_new_headless(CONF_lines, CONF_cols);
+
+  pangoterm_set_fonts(pt, CONF_font, CONF_font_italic, alt_fonts);
+  pangoterm_set_write_fn(pt, &write_discard, NULL);
 
   pangoterm_start(pt);
 
+  /* Don't count font loading and the initial reset */
+  pangoterm_set_collect_stats(pt, TRUE);
+
+  gint64 start_time = g_get_monotonic_time();
+
+  bench.frame_interval = CONF_bench_fps > 0 ? G_USEC_PER_SEC / CONF_bench_fps : 0;
+  bench.next_frame = start_time + bench.frame_interval;
+
+  /* A recording is replayed as fast as possible, resizes included */
+  RecordReader reader;
+  if(record_open(&reader, bytes, len)) {
+    RecordEvent ev;
+    len = 0;
+    while(record_read_event(&reader, &ev)) {
+      if(ev.type == 'd') {
+        bench_push(pt, ev.bytes, ev.len);
+        len += ev.len;
+      }
+      else
+        pangoterm_set_size(pt, ev.rows, ev.cols);
+    }
+  }
+  else
+    bench_push(pt, bytes, len);
+
+  if(pangoterm_frame_pending(pt))
+    pangoterm_render_frame(pt);
+
+  gint64 elapsed = g_get_monotonic_time() - start_time;
+
+  printf("bench: %" G_GSIZE_FORMAT " bytes in %.3f sec, %.2f MB/s\n",
+      len, elapsed / (double)G_USEC_PER_SEC, elapsed ? (double)len / elapsed : 0.0);
+  pangoterm_print_stats(pt, stdout);
+
+  pangoterm_free(pt);
+  g_free(bytes);
+
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  VTERM_CHECK_VERSION;
+
+  // setenv("GDK_BACKEND", "x11", TRUE);
+  if(!conf_parse(&argc, &argv))
+    exit(1);
+
+  // GLib has consumed the options, but it might leave a -- in place in argv[1]
+  if(argc > 1 && strcmp(argv[1], "--") == 0) {
+    argv++;
+    argc--;
+  }
+
+  /* Benchmarking needs no display, so do it before GTK wants one */
+  if(CONF_bench && CONF_bench[0])
+    return run_bench(CONF_bench);
+
+  gtk_init();
+  setlocale(LC_CTYPE, NULL);
+
+  PangoTerm *pt = pangoterm_new(CONF_lines, CONF_cols);
+
+  if(CONF_stats)
+    pangoterm_set_collect_stats(pt, TRUE);
+
+  pangoterm_set_fonts(pt, CONF_font, CONF_font_italic, alt_fonts);
+
+  pangoterm_set_title(pt, CONF_title);
+
+  if(CONF_replay && CONF_replay[0])
+    pangoterm_set_write_fn(pt, &write_discard, NULL);
+  else
+    spawn_child(pt, argc, argv);
+
+  if(CONF_record && CONF_record[0] && !(CONF_replay && CONF_replay[0])) {
+    recorder.file = fopen(CONF_record, "wb");
+    if(!recorder.file) {
+      fprintf(stderr, "Cannot open %s - %s\n", CONF_record, strerror(errno));
+      exit(1);
+    }
+
+    fputs(RECORD_MAGIC, recorder.file);
+    recorder.last_time = g_get_monotonic_time();
+    record_resize(CONF_lines, CONF_cols);
+  }
+
+  pangoterm_start(pt);
+
+  if(CONF_replay && CONF_replay[0] && !replay_start(pt, CONF_replay))
+    exit(1);
+
   while (g_list_model_get_n_items (gtk_window_get_toplevels ()) > 0)
     g_main_context_iteration (NULL, TRUE);
 
   // gtk_main();
 
+  if(recorder.file && fclose(recorder.file) != 0)
+    fprintf(stderr, "Cannot write %s - %s\n", CONF_record, strerror(errno));
+
+  if(CONF_stats) {
+    guint64 reads = readstats.reads ? readstats.reads : 1;
+    guint64 wakeups = readstats.wakeups ? readstats.wakeups : 1;
+
+    fprintf(stderr, "PTY: %" G_GUINT64_FORMAT " bytes in %" G_GUINT64_FORMAT " reads (%" G_GUINT64_FORMAT " polls)\n",
+        readstats.bytes, readstats.reads, readstats.polls);
+    fprintf(stderr, "PTY: %.1f bytes/read, %.2f reads/wakeup over %" G_GUINT64_FORMAT " wakeups\n",
+        (double)readstats.bytes / reads, (double)readstats.reads / wakeups, readstats.wakeups);
+
+    guint64 latency_count = writestats.latency_count ? writestats.latency_count : 1;
+
+    fprintf(stderr, "PTY: wrote %" G_GUINT64_FORMAT " bytes in %" G_GUINT64_FORMAT " writes, %" G_GUINT64_FORMAT " deferred, at most %" G_GUINT64_FORMAT " queued\n",
+        writestats.bytes, writestats.writes, writestats.deferred, writestats.max_queued);
+    fprintf(stderr, "PTY: write latency %.1f usec mean, %" G_GINT64_FORMAT " usec max\n",
+        (double)writestats.latency_total / latency_count, writestats.latency_max);
+
+    pangoterm_print_stats(pt, stderr);
+  }
+
   pangoterm_free(pt);
 
   return 0;
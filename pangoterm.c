@@ -1,7 +1,17 @@
+/* for mmap(), pwrite() */
+#define _DEFAULT_SOURCE
+
 #include "pangoterm.h"
 
+#include <errno.h>
 #include <string.h>  // memmove
+#include <unistd.h>
 #include <wctype.h> 
+#include <sys/mman.h>
+
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
 #include <ibus.h>
 
 #include <cairo/cairo.h>
@@ -13,6 +23,9 @@
 #include "conf.h"
 
 #undef DEBUG_SHOW_LINECONTINUATION
+/* Count heap allocations made while repainting, and complain about any in a
+ * frame that had no cache misses to explain them by aborting. Needs glibc */
+#undef DEBUG_ALLOC_COUNT
 
 CONF_STRING(foreground, 0, "gray90", "Foreground colour", "COL");
 CONF_STRING(background, 0, "black",  "Background colour", "COL");
@@ -48,6 +61,12 @@ CONF_BOOL(altscreen, 0, TRUE, "Alternate screen buffer switching");
 CONF_BOOL(altscreen_scroll, 0, FALSE, "Emulate arrows for mouse scrolling in alternate screen buffer");
 
 CONF_INT(scrollback_size, 0, 1000, "Scrollback size", "LINES");
+CONF_INT(scrollback_hot, 0, 5000, "Scrollback lines kept uncompressed", "LINES");
+CONF_STRING(scrollback_file, 0, "", "Spill unlimited scrollback to a file in this directory", "DIR");
+
+CONF_INT(run_cache_size, 0, 1024, "Number of shaped text runs to cache", "NUM");
+
+CONF_INT(render_threads, 0, 0, "Threads for repainting large areas (0 = one per core, 1 = none)", "NUM");
 
 CONF_INT(scrollbar_width, 0, 3, "Scroll bar width", "PIXELS");
 
@@ -108,11 +127,146 @@ typedef struct {
     .end_pcol   = rect.end_col,                     \
   }
 
+/* Scrollback lines are stored compactly; a run-length table of pen spans,
+ * followed by the text of each cell as a NUL-terminated UTF-8 string. The
+ * right half of a double-width character is stored as a lone 0xff byte.
+ */
+
+typedef struct {
+  int cols;
+  VTermScreenCellAttrs attrs;
+  VTermColor fg, bg;
+} PangoTermScrollbackSpan;
+
 typedef struct {
   int cols;
-  VTermScreenCell cells[];
+  int n_spans;
+  size_t textlen;
+  PangoTermScrollbackSpan spans[];
+  /* followed by textlen bytes of cell text */
 } PangoTermScrollbackLine;
 
+#define SB_LINE_TEXT(line) ((char *)((line)->spans + (line)->n_spans))
+
+/* Lines are allocated at their exact size, but 8-byte aligned when packed
+ * together into a block */
+#define SB_LINE_EXACT_SIZE(line) \
+  (sizeof(PangoTermScrollbackLine) + (line)->n_spans * sizeof((line)->spans[0]) + (line)->textlen)
+#define SB_LINE_SIZE(line) \
+  ((SB_LINE_EXACT_SIZE(line) + 7) & ~7)
+
+/* Scrollback beyond the hot window is kept as zlib-compressed blocks of
+ * SB_BLOCK_LINES packed lines, oldest line first */
+
+#define SB_BLOCK_LINES 256
+
+typedef struct {
+  gsize rawlen;
+  gsize len;
+  guint8 data[];
+} PangoTermScrollbackBlock;
+
+/* Simple glyphs are rasterized once into an A8 atlas surface and composited
+ * from there as masks, rather than laid out by Pango every time they're drawn.
+ * Each slot is big enough for a double-width glyph plus some overhang */
+
+#define ATLAS_SIZE 2048
+
+typedef struct {
+  guint64 key;
+  int width;
+  /* A view of its slot in the atlas, or NULL if the glyph has no ink */
+  cairo_surface_t *mask;
+} PangoTermGlyph;
+
+#define GLYPH_KEY(c, width, attrs) \
+  ((guint64)(c) | (guint64)(width) << 21 | (guint64)(attrs).bold << 23 | \
+   (guint64)(attrs).italic << 24 | (guint64)(attrs).font << 25)
+
+/* Printable ASCII in the primary font skips Pango and the atlas entirely. Its
+ * glyphs are looked up once per font, for each combination of bold and italic,
+ * and drawn with one cairo_show_glyphs() per run */
+
+#define ASCII_FIRST 0x20
+#define ASCII_COUNT (0x7f - ASCII_FIRST)
+
+#define ASCII_VARIANT(attrs) ((attrs).bold | (attrs).italic << 1)
+
+/* Text that does need Pango is cached as shaped glyph strings, keyed by the
+ * text, cell widths and the pen attributes that affect shaping */
+
+typedef struct {
+  PangoFont *font;
+  PangoGlyphString *glyphs;
+  /* Origin relative to the start of the run, in Pango units */
+  int x;
+  int baseline;
+} PangoTermShapedItem;
+
+typedef struct {
+  int n_items;
+  PangoTermShapedItem items[];
+} PangoTermShapedRun;
+
+typedef struct {
+  unsigned int bold      : 1;
+  unsigned int underline : 2;
+  unsigned int italic    : 1;
+  unsigned int reverse   : 1;
+  unsigned int strike    : 1;
+  unsigned int font      : 4;
+  unsigned int dwl       : 1;
+  unsigned int dhl       : 2;
+} PangoTermPenAttrs;
+
+/* Each distinct pen is interned into the style table once, with everything
+ * flush_pending needs to draw in it built up front */
+typedef struct {
+  guint64 key;
+  int id;
+  PangoTermPenAttrs attrs;
+  GdkRGBA fg_col;
+  GdkRGBA bg_col;
+  PangoAttrList *pangoattrs;
+  /* Sources for the background and the glyphs, with reverse applied */
+  cairo_pattern_t *bg_source;
+  cairo_pattern_t *fg_source;
+  /* The background as a buffer pixel, for filling spans directly */
+  guint32 bg_pixel;
+} PangoTermStyle;
+
+/* A cell prepared on the main thread for a raster worker */
+typedef struct {
+  uint32_t chars[VTERM_MAX_CHARS_PER_CELL];
+  const PangoTermStyle *style;
+  int width;
+} PangoTermRasterCell;
+
+typedef struct {
+  PangoTerm *pt;
+  int start_prow, end_prow;
+  int start_pcol, end_pcol;
+} PangoTermRasterBand;
+
+/* Styles are forgotten all at once after this many */
+#define STYLE_TABLE_MAX 4096
+
+/* No real style has the top bits of its key set */
+#define STYLE_KEY_NONE G_MAXUINT64
+
+#define SHADOW_INVALID 0xff
+
+/* Rendering phases timed when collecting stats. Time is only ever counted
+ * against the innermost phase, so these never overlap */
+enum {
+  PHASE_OTHER,
+  PHASE_PARSE,
+  PHASE_DAMAGE,
+  PHASE_FLUSH,
+  PHASE_BLIT,
+  PHASE_COUNT
+};
+
 struct PangoTerm {
   VTerm *vt;
   VTermScreen *vts;
@@ -126,28 +280,108 @@ struct PangoTerm {
   /* Pending glyphs to flush in flush_pending */
   GString *glyphs;
   GArray *glyph_widths;
+  int glyphs_reserved_cols;
   /* Pending area to erase in flush_pending */
   int erase_columns;
   /* Is pending area DWL? */
   int pending_dwl;
+  /* Pending glyphs to flush in flush_pending that come from the atlas; a run
+   * is drawn either wholly from the atlas or wholly by Pango */
+  GPtrArray *atlas_pending;
+
+  GHashTable *run_cache;
+  GString *run_cache_key;
 
   struct {
-    struct {
-      unsigned int bold      : 1;
-      unsigned int underline : 2;
-      unsigned int italic    : 1;
-      unsigned int reverse   : 1;
-      unsigned int strike    : 1;
-      unsigned int font      : 4;
-      unsigned int dwl       : 1;
-      unsigned int dhl       : 2;
-    } attrs;
+    cairo_surface_t *surface;
+    PangoLayout *layout;
+    GHashTable *glyphs;
+    PangoTermGlyph *slots;
+    int n_slots;
+    int n_used;
+    int per_row;
+    int slot_width, slot_height;
+    int pad_x, pad_y;
+  } atlas;
+
+  struct {
+    cairo_scaled_font_t *font[4];
+    /* 0 where Pango has to draw it, PANGO_GLYPH_EMPTY where there's no ink */
+    PangoGlyph glyph[4][ASCII_COUNT];
+    /* Where to put the glyph relative to the top left of its cell */
+    double x[4][ASCII_COUNT];
+    double y[4][ASCII_COUNT];
+  } ascii;
+  /* Pending glyphs to flush in flush_pending that come from the ASCII table,
+   * already positioned */
+  cairo_glyph_t *ascii_pending;
+  int n_ascii_pending;
+
+  struct {
+    PangoTermPenAttrs attrs;
     GdkRGBA fg_col;
     GdkRGBA bg_col;
     PangoAttrList *pangoattrs;
     PangoLayout *layout;
+    guint64 key;
+    const PangoTermStyle *style;
   } pen;
 
+  /* Interned styles, by key and by id */
+  GHashTable *styles;
+  GPtrArray *styles_by_id;
+  /* Columns of each screen row damaged by vterm since the last frame, in
+   * vterm's coordinates; empty where c0 >= c1 */
+  struct {
+    int c0, c1;
+  } *damage_rows;
+  int n_damage_rows;
+  bool damaged;
+
+  /* Counts resets of the style table */
+  guint style_generation;
+
+  /* Worker threads that paint large areas, started the first time one is
+   * painted. Workers only read from here while the main thread waits for
+   * them */
+  struct {
+    GThreadPool *pool;
+    int n_threads;
+    PangoTermRasterBand *bands;
+    GMutex lock;
+    GCond done;
+    int pending;
+    /* Indexed by prow * cols + pcol */
+    PangoTermRasterCell *cells;
+    int n_cells;
+    guint8 *serial_rows;
+    guint8 *changed_rows;
+    /* What shadow_diff() found, indexed as cells */
+    guint8 *changed_cells;
+    int n_rows;
+    PangoFontDescription *fontdesc;
+    guint font_serial;
+  } raster;
+
+  /* What each visible cell was last painted as, indexed by prow * cols + pcol,
+   * so damage to cells that didn't really change can be skipped. Combining
+   * characters are folded into a hash with the top bit set. The width is
+   * SHADOW_INVALID where the pixels are unknown */
+  struct {
+    guint32 *chars;
+    guint16 *styles;
+    guint8  *widths;
+    int rows, cols;
+    /* The row being compared, and which of its cells changed */
+    guint32 *new_chars;
+    guint16 *new_styles;
+    guint8  *new_widths;
+    guint8  *changed;
+    /* Saves interning the same style for every cell */
+    guint64 last_key;
+    int last_id;
+  } shadow;
+
   int rows;
   int cols;
 
@@ -156,7 +390,50 @@ struct PangoTerm {
 
   int scroll_size;
   int scroll_current;
+  /* sb_buffer is a ring of the sb_hot most recent lines; sb_head is the slot
+   * of the most recent one */
   PangoTermScrollbackLine **sb_buffer;
+  int sb_capacity;
+  int sb_hot;
+  int sb_head;
+
+  /* Lines evicted from the ring collect in sb_cold_pending until there are
+   * enough to compress into a block. Both arrays are oldest first. The oldest
+   * sb_cold_skip lines are past the scrollback size, and kept only until
+   * their block can go */
+  GPtrArray *sb_cold_pending;
+  GPtrArray *sb_cold_blocks;
+  int sb_cold_skip;
+  GConverter *sb_compressor;
+  GConverter *sb_decompressor;
+  /* The most recently decompressed block */
+  const PangoTermScrollbackBlock *sb_cold_cache_block;
+  GByteArray *sb_cold_cache;
+  gsize sb_cold_cache_offsets[SB_BLOCK_LINES];
+
+  /* Instead of the cold tier, lines evicted from the ring may be spilled to
+   * a pair of unlinked files; the packed lines, and the offset of each. New
+   * lines collect in the write buffers and both files are mapped read-only
+   * when a line is needed back */
+  int sb_spill_fd;
+  int sb_spill_index_fd;
+  GByteArray *sb_spill_wbuf;
+  GArray *sb_spill_wbuf_index;
+  guint64 sb_spill_len;
+  int sb_spill_lines;
+  int sb_spill_flushed_lines;
+  guint8 *sb_spill_map;
+  gsize sb_spill_map_len;
+  /* Stands in for lines lost to a failed write */
+  PangoTermScrollbackLine *sb_spill_blank;
+  guint64 *sb_spill_index_map;
+  int sb_spill_mapped_lines;
+
+  /* The most recently decoded scrollback line, as fetch_cell reads a line
+   * one column at a time */
+  const PangoTermScrollbackLine *sb_decoded_line;
+  VTermScreenCell *sb_decoded;
+  int sb_decoded_cols;
 
   PangoTermWriteFn *writefn;
   void *writefn_data;
@@ -179,23 +456,62 @@ struct PangoTerm {
   int has_focus;
   int cursor_visible;    /* VTERM_PROP_CURSORVISIBLE */
   int cursor_blinkstate; /* during high state of blink */
-  int cursor_hidden_for_redraw; /* true to temporarily hide during redraw */
   VTermPos cursorpos;
   GdkRGBA cursor_col;
   int cursor_shape;
-
-#define CURSOR_ENABLED(pt) ((pt)->cursor_visible && !(pt)->cursor_hidden_for_redraw)
+  /* The cursor is drawn over the buffer when blitting, never into it. Where it
+   * was last drawn on the headless target, so the buffer can cover it again */
+  GdkRectangle cursor_drawn;
 
   guint cursor_timer_id;
 
+  /* Rendering is driven by the frame clock; set while a frame is pending */
+  guint frame_tick_id;
+  /* Without a widget there is no frame clock; the caller renders frames */
+  bool frame_pending;
+
+  bool collect_stats;
+  struct {
+    guint64 bytes;
+    guint64 frames;
+    guint64 atlas_hits;
+    guint64 atlas_misses;
+    guint64 atlas_resets;
+    guint64 run_hits;
+    guint64 run_misses;
+#ifdef DEBUG_ALLOC_COUNT
+    guint64 frame_allocs_base;
+    guint64 frame_misses_base;
+#endif
+    int phase;
+    gint64 phase_start;
+    gint64 phase_time[PHASE_COUNT];
+  } stats;
+
   GtkWidget *termwin;
   GtkWidget *termda;
 
-  cairo_surface_t *buffer;
+  /* What the terminal looks like, as one image strip per row so that moving
+   * whole rows only moves pointers */
+  cairo_surface_t **buffer;
+  int n_buffer_rows;
+  /* Device pixels per logical pixel; everything but the raw pixel access in
+   * buffer_fill_span() and buffer_copy_rect() works in logical pixels */
+  int buffer_scale;
+  /* Stands in for the window when running headless */
+  cairo_surface_t *headless_target;
   GdkSurface *termdraw; // TODO: deleda est
   GdkCairoContext *cairo_context;
-  /* area in buffer that needs flushing to termdraw */
-  GdkRectangle dirty_area;
+  /* Span of pixels in each row of the buffer that needs flushing to the
+   * window; empty where x0 >= x1 */
+  struct {
+    int x0, x1;
+  } *dirty_rows;
+  int n_dirty_rows;
+  bool dirty;
+  /* Texture of each row of the buffer as last handed to GTK; NULL where it
+   * needs making again */
+  GskRenderNode **row_nodes;
 
   /* These four positions relate to the click/drag highlight state */
 
@@ -211,6 +527,10 @@ struct PangoTerm {
   bool highlight_valid;
   VTermPos highlight_start;
   VTermPos highlight_stop;
+  /* The selection inverts the buffer when blitting. Where it was last drawn on
+   * the headless target, so the buffer can cover it again */
+  GdkRectangle *selection_drawn;
+  int n_selection_drawn;
 
   GdkClipboard *selection_primary;
   GdkClipboard *selection_clipboard;
@@ -371,6 +691,487 @@ static void pos_prev(PangoTerm *pt, VTermPos *pos)
   }
 }
 
+static int attrs_equal(const VTermScreenCellAttrs *a, const VTermScreenCellAttrs *b)
+{
+  return a->bold == b->bold &&
+         a->underline == b->underline &&
+         a->italic == b->italic &&
+         a->blink == b->blink &&
+         a->reverse == b->reverse &&
+         a->conceal == b->conceal &&
+         a->strike == b->strike &&
+         a->font == b->font &&
+         a->dwl == b->dwl &&
+         a->dhl == b->dhl;
+}
+
+static PangoTermScrollbackLine *sb_line_encode(int cols, const VTermScreenCell *cells)
+{
+  int n_spans = 0;
+  size_t textlen = 0;
+
+  for(int col = 0; col < cols; col++) {
+    const VTermScreenCell *cell = cells + col;
+
+    if(!col ||
+        !attrs_equal(&cell->attrs, &cells[col-1].attrs) ||
+        !vterm_color_is_equal(&cell->fg, &cells[col-1].fg) ||
+        !vterm_color_is_equal(&cell->bg, &cells[col-1].bg))
+      n_spans++;
+
+    if(cell->chars[0] == (uint32_t)-1)
+      textlen++;
+    else
+      for(int i = 0; i < VTERM_MAX_CHARS_PER_CELL && cell->chars[i]; i++)
+        textlen += g_unichar_to_utf8(cell->chars[i], NULL);
+
+    textlen++; /* NUL */
+  }
+
+  PangoTermScrollbackLine *line = g_malloc(sizeof(PangoTermScrollbackLine) +
+      n_spans * sizeof(line->spans[0]) + textlen);
+  line->cols    = cols;
+  line->n_spans = n_spans;
+  line->textlen = textlen;
+
+  PangoTermScrollbackSpan *span = NULL;
+  char *text = SB_LINE_TEXT(line);
+
+  for(int col = 0; col < cols; col++) {
+    const VTermScreenCell *cell = cells + col;
+
+    if(!span ||
+        !attrs_equal(&cell->attrs, &span->attrs) ||
+        !vterm_color_is_equal(&cell->fg, &span->fg) ||
+        !vterm_color_is_equal(&cell->bg, &span->bg)) {
+      span = span ? span + 1 : line->spans;
+      span->cols  = 0;
+      span->attrs = cell->attrs;
+      span->fg    = cell->fg;
+      span->bg    = cell->bg;
+    }
+    span->cols++;
+
+    if(cell->chars[0] == (uint32_t)-1)
+      *(text++) = 0xff;
+    else
+      for(int i = 0; i < VTERM_MAX_CHARS_PER_CELL && cell->chars[i]; i++)
+        text += g_unichar_to_utf8(cell->chars[i], text);
+
+    *(text++) = 0;
+  }
+
+  return line;
+}
+
+/* Decodes at most cols cells of the line into cells[] */
+static void sb_line_decode(const PangoTermScrollbackLine *line, VTermScreenCell *cells, int cols)
+{
+  if(cols > line->cols)
+    cols = line->cols;
+
+  const PangoTermScrollbackSpan *span = line->spans;
+  int span_remaining = span->cols;
+  const char *text = SB_LINE_TEXT(line);
+
+  for(int col = 0; col < cols; col++) {
+    VTermScreenCell *cell = cells + col;
+
+    if(!span_remaining) {
+      span++;
+      span_remaining = span->cols;
+    }
+    span_remaining--;
+
+    *cell = (VTermScreenCell) { { 0 } };
+    cell->width = 1;
+    cell->attrs = span->attrs;
+    cell->fg    = span->fg;
+    cell->bg    = span->bg;
+
+    if((unsigned char)text[0] == 0xff) {
+      cell->chars[0] = (uint32_t)-1;
+      text++;
+      /* The left half of this character is the previous cell */
+      if(col > 0)
+        cells[col-1].width = 2;
+    }
+    else
+      for(int i = 0; text[0]; i++) {
+        if(i < VTERM_MAX_CHARS_PER_CELL)
+          cell->chars[i] = g_utf8_get_char(text);
+        text = g_utf8_next_char(text);
+      }
+
+    text++; /* NUL */
+  }
+}
+
+static const VTermScreenCell *sb_line_cells(PangoTerm *pt, const PangoTermScrollbackLine *line)
+{
+  if(pt->sb_decoded_line == line)
+    return pt->sb_decoded;
+
+  if(line->cols > pt->sb_decoded_cols) {
+    pt->sb_decoded = g_renew(VTermScreenCell, pt->sb_decoded, line->cols);
+    pt->sb_decoded_cols = line->cols;
+  }
+
+  sb_line_decode(line, pt->sb_decoded, line->cols);
+  pt->sb_decoded_line = line;
+
+  return pt->sb_decoded;
+}
+
+static void sb_line_free(PangoTerm *pt, PangoTermScrollbackLine *line)
+{
+  if(pt->sb_decoded_line == line)
+    pt->sb_decoded_line = NULL;
+
+  g_free(line);
+}
+
+/* Runs all of in through the converter, appending the result to out */
+static gboolean sb_convert(GConverter *converter, const guint8 *in, gsize inlen, GByteArray *out)
+{
+  gsize chunk = inlen + 64;
+
+  g_converter_reset(converter);
+
+  while(1) {
+    guint oldlen = out->len;
+    g_byte_array_set_size(out, oldlen + chunk);
+
+    gsize bytes_read, bytes_written;
+    GError *error = NULL;
+    GConverterResult res = g_converter_convert(converter,
+        in, inlen, out->data + oldlen, chunk,
+        G_CONVERTER_INPUT_AT_END, &bytes_read, &bytes_written, &error);
+
+    if(res == G_CONVERTER_ERROR) {
+      g_byte_array_set_size(out, oldlen);
+
+      if(g_error_matches(error, G_IO_ERROR, G_IO_ERROR_NO_SPACE)) {
+        /* Output buffer too small for even one step; retry with more */
+        g_error_free(error);
+        chunk *= 2;
+        continue;
+      }
+
+      g_warning("Scrollback (de)compression failed: %s", error->message);
+      g_error_free(error);
+      return FALSE;
+    }
+
+    g_byte_array_set_size(out, oldlen + bytes_written);
+    in    += bytes_read;
+    inlen -= bytes_read;
+
+    if(res == G_CONVERTER_FINISHED)
+      return TRUE;
+  }
+}
+
+/* Append a line to packed storage, zeroing the padding that aligns the next */
+static void sb_line_pack(GByteArray *buf, const PangoTermScrollbackLine *line)
+{
+  guint oldlen = buf->len;
+
+  g_byte_array_set_size(buf, oldlen + SB_LINE_SIZE(line));
+  memcpy(buf->data + oldlen, line, SB_LINE_EXACT_SIZE(line));
+  memset(buf->data + oldlen + SB_LINE_EXACT_SIZE(line), 0,
+      SB_LINE_SIZE(line) - SB_LINE_EXACT_SIZE(line));
+}
+
+static int sb_cold_lines(PangoTerm *pt)
+{
+  return pt->sb_cold_blocks->len * SB_BLOCK_LINES + pt->sb_cold_pending->len - pt->sb_cold_skip;
+}
+
+static void sb_cold_drop_blocks(PangoTerm *pt, guint n_blocks)
+{
+  for(guint i = 0; i < n_blocks; i++) {
+    PangoTermScrollbackBlock *block = g_ptr_array_index(pt->sb_cold_blocks, i);
+    if(pt->sb_cold_cache_block == block)
+      pt->sb_cold_cache_block = NULL;
+    g_free(block);
+  }
+
+  g_ptr_array_remove_range(pt->sb_cold_blocks, 0, n_blocks);
+}
+
+static void sb_cold_compress_pending(PangoTerm *pt)
+{
+  GByteArray *raw = g_byte_array_new();
+
+  for(guint i = 0; i < pt->sb_cold_pending->len; i++) {
+    PangoTermScrollbackLine *line = g_ptr_array_index(pt->sb_cold_pending, i);
+    sb_line_pack(raw, line);
+  }
+
+  GByteArray *compressed = g_byte_array_new();
+  if(sb_convert(pt->sb_compressor, raw->data, raw->len, compressed)) {
+    PangoTermScrollbackBlock *block = g_malloc(sizeof(PangoTermScrollbackBlock) + compressed->len);
+    block->rawlen = raw->len;
+    block->len    = compressed->len;
+    memcpy(block->data, compressed->data, compressed->len);
+
+    g_ptr_array_add(pt->sb_cold_blocks, block);
+  }
+  else {
+    /* These lines are lost, and everything older with them so scrollback
+     * stays in order; it just ends sooner */
+    pt->scroll_current -= sb_cold_lines(pt);
+    pt->sb_cold_skip = 0;
+    sb_cold_drop_blocks(pt, pt->sb_cold_blocks->len);
+  }
+
+  g_byte_array_free(compressed, TRUE);
+  g_byte_array_free(raw, TRUE);
+
+  for(guint i = 0; i < pt->sb_cold_pending->len; i++)
+    sb_line_free(pt, g_ptr_array_index(pt->sb_cold_pending, i));
+  g_ptr_array_set_size(pt->sb_cold_pending, 0);
+}
+
+static void sb_cold_push(PangoTerm *pt, PangoTermScrollbackLine *line)
+{
+  g_ptr_array_add(pt->sb_cold_pending, line);
+
+  if(pt->sb_cold_pending->len == SB_BLOCK_LINES)
+    sb_cold_compress_pending(pt);
+
+  /* Lines go off the old end one at a time once over the scrollback size;
+   * their memory a whole block at a time. The caller counts the line that
+   * took this one's slot in the ring after this returns */
+  int excess = MIN(pt->scroll_current + 1 - pt->scroll_size, sb_cold_lines(pt));
+  if(excess > 0) {
+    pt->sb_cold_skip += excess;
+    pt->scroll_current -= excess;
+  }
+
+  guint n_blocks = MIN(pt->sb_cold_skip / SB_BLOCK_LINES, pt->sb_cold_blocks->len);
+  if(n_blocks) {
+    sb_cold_drop_blocks(pt, n_blocks);
+    pt->sb_cold_skip -= n_blocks * SB_BLOCK_LINES;
+  }
+
+  if(pt->scroll_offs > pt->scroll_current)
+    pt->scroll_offs = pt->scroll_current;
+}
+
+/* index 0 is the newest cold line */
+static PangoTermScrollbackLine *sb_cold_line_at(PangoTerm *pt, int index)
+{
+  int n_pending = pt->sb_cold_pending->len;
+  if(index < n_pending)
+    return g_ptr_array_index(pt->sb_cold_pending, n_pending - 1 - index);
+  index -= n_pending;
+
+  const PangoTermScrollbackBlock *block =
+    g_ptr_array_index(pt->sb_cold_blocks, pt->sb_cold_blocks->len - 1 - index / SB_BLOCK_LINES);
+
+  if(pt->sb_cold_cache_block != block) {
+    /* The decoded line may be about to point at different data */
+    pt->sb_decoded_line = NULL;
+    pt->sb_cold_cache_block = NULL;
+
+    g_byte_array_set_size(pt->sb_cold_cache, 0);
+    if(!sb_convert(pt->sb_decompressor, block->data, block->len, pt->sb_cold_cache) ||
+        pt->sb_cold_cache->len != block->rawlen) {
+      fprintf(stderr, "ARGH! Failed to decompress scrollback block\n");
+      abort();
+    }
+
+    gsize offset = 0;
+    for(int i = 0; i < SB_BLOCK_LINES; i++) {
+      pt->sb_cold_cache_offsets[i] = offset;
+      offset += SB_LINE_SIZE((PangoTermScrollbackLine *)(pt->sb_cold_cache->data + offset));
+    }
+
+    pt->sb_cold_cache_block = block;
+  }
+
+  int line_in_block = SB_BLOCK_LINES - 1 - index % SB_BLOCK_LINES;
+  return (PangoTermScrollbackLine *)(pt->sb_cold_cache->data + pt->sb_cold_cache_offsets[line_in_block]);
+}
+
+static int sb_spill_open_file(const char *dir)
+{
+  gchar *path = g_build_filename(dir, "pangoterm-scrollback-XXXXXX", NULL);
+
+  int fd = g_mkstemp(path);
+  if(fd != -1)
+    /* Nobody else needs to find it, and it goes away with us */
+    unlink(path);
+  else
+    fprintf(stderr, "Cannot create scrollback file %s - %s\n", path, strerror(errno));
+
+  g_free(path);
+
+  return fd;
+}
+
+static gboolean sb_spill_pwrite(int fd, const void *bytes, size_t len, off_t offset)
+{
+  while(len) {
+    ssize_t written = pwrite(fd, bytes, len, offset);
+    if(written == -1 && errno == EINTR)
+      continue;
+    if(written <= 0)
+      return FALSE;
+
+    bytes   = (const char *)bytes + written;
+    len    -= written;
+    offset += written;
+  }
+
+  return TRUE;
+}
+
+static void sb_spill_flush(PangoTerm *pt)
+{
+  int n_lines = pt->sb_spill_wbuf_index->len;
+  if(!n_lines)
+    return;
+
+  if(sb_spill_pwrite(pt->sb_spill_fd,
+        pt->sb_spill_wbuf->data, pt->sb_spill_wbuf->len, pt->sb_spill_len) &&
+      sb_spill_pwrite(pt->sb_spill_index_fd,
+        pt->sb_spill_wbuf_index->data, n_lines * sizeof(guint64),
+        (off_t)pt->sb_spill_flushed_lines * sizeof(guint64))) {
+    pt->sb_spill_len += pt->sb_spill_wbuf->len;
+    pt->sb_spill_flushed_lines += n_lines;
+  }
+  else {
+    /* Lose these lines rather than the whole terminal; the next flush may
+     * well succeed */
+    fprintf(stderr, "Cannot write scrollback file - %s\n", strerror(errno));
+    pt->sb_spill_lines -= n_lines;
+    pt->scroll_current -= n_lines;
+    if(pt->scroll_offs > pt->scroll_current)
+      pt->scroll_offs = pt->scroll_current;
+  }
+
+  g_byte_array_set_size(pt->sb_spill_wbuf, 0);
+  g_array_set_size(pt->sb_spill_wbuf_index, 0);
+}
+
+static void sb_spill_push(PangoTerm *pt, PangoTermScrollbackLine *line)
+{
+  guint64 offset = pt->sb_spill_len + pt->sb_spill_wbuf->len;
+  g_array_append_val(pt->sb_spill_wbuf_index, offset);
+
+  sb_line_pack(pt->sb_spill_wbuf, line);
+
+  pt->sb_spill_lines++;
+
+  sb_line_free(pt, line);
+
+  if(pt->sb_spill_wbuf->len >= 64*1024)
+    sb_spill_flush(pt);
+}
+
+static void sb_spill_remap(PangoTerm *pt)
+{
+  /* The decoded line may be about to point at unmapped memory */
+  pt->sb_decoded_line = NULL;
+
+  if(pt->sb_spill_map) {
+    munmap(pt->sb_spill_map, pt->sb_spill_map_len);
+    munmap(pt->sb_spill_index_map, pt->sb_spill_mapped_lines * sizeof(guint64));
+  }
+
+  pt->sb_spill_map_len = pt->sb_spill_len;
+  pt->sb_spill_mapped_lines = pt->sb_spill_flushed_lines;
+
+  pt->sb_spill_map = mmap(NULL, pt->sb_spill_map_len,
+      PROT_READ, MAP_SHARED, pt->sb_spill_fd, 0);
+  pt->sb_spill_index_map = mmap(NULL, pt->sb_spill_mapped_lines * sizeof(guint64),
+      PROT_READ, MAP_SHARED, pt->sb_spill_index_fd, 0);
+
+  if(pt->sb_spill_map == MAP_FAILED || pt->sb_spill_index_map == MAP_FAILED) {
+    fprintf(stderr, "ARGH! Cannot map scrollback file - %s\n", strerror(errno));
+    abort();
+  }
+}
+
+/* index 0 is the newest spilled line */
+static PangoTermScrollbackLine *sb_spill_line_at(PangoTerm *pt, int index)
+{
+  int line = pt->sb_spill_lines - 1 - index;
+
+  if(line >= pt->sb_spill_flushed_lines) {
+    sb_spill_flush(pt);
+    /* A failed write drops the unflushed lines */
+    line = pt->sb_spill_lines - 1 - index;
+  }
+
+  if(line < 0 || line >= pt->sb_spill_flushed_lines) {
+    if(!pt->sb_spill_blank) {
+      VTermScreenCell blank = { { 0 } };
+      blank.width = 1;
+      vterm_state_get_default_colors(vterm_obtain_state(pt->vt), &blank.fg, &blank.bg);
+      pt->sb_spill_blank = sb_line_encode(1, &blank);
+    }
+    return pt->sb_spill_blank;
+  }
+
+  if(line >= pt->sb_spill_mapped_lines)
+    sb_spill_remap(pt);
+
+  return (PangoTermScrollbackLine *)(pt->sb_spill_map + pt->sb_spill_index_map[line]);
+}
+
+/* index 0 is the most recently pushed line, 1 the one before, etc... */
+static PangoTermScrollbackLine *sb_line_at(PangoTerm *pt, int index)
+{
+  if(index < pt->sb_hot)
+    return pt->sb_buffer[(pt->sb_head + index) % pt->sb_capacity];
+
+  if(pt->sb_spill_fd != -1)
+    return sb_spill_line_at(pt, index - pt->sb_hot);
+
+  return sb_cold_line_at(pt, index - pt->sb_hot);
+}
+
+/* Every tier, and the files behind the spill */
+static void sb_free(PangoTerm *pt)
+{
+  for(int i = 0; i < pt->sb_hot; i++)
+    sb_line_free(pt, pt->sb_buffer[(pt->sb_head + i) % pt->sb_capacity]);
+  g_free(pt->sb_buffer);
+
+  if(pt->sb_cold_pending) {
+    for(guint i = 0; i < pt->sb_cold_pending->len; i++)
+      sb_line_free(pt, g_ptr_array_index(pt->sb_cold_pending, i));
+    g_ptr_array_free(pt->sb_cold_pending, TRUE);
+
+    sb_cold_drop_blocks(pt, pt->sb_cold_blocks->len);
+    g_ptr_array_free(pt->sb_cold_blocks, TRUE);
+
+    g_object_unref(pt->sb_compressor);
+    g_object_unref(pt->sb_decompressor);
+    g_byte_array_free(pt->sb_cold_cache, TRUE);
+  }
+
+  if(pt->sb_spill_fd != -1) {
+    if(pt->sb_spill_map) {
+      munmap(pt->sb_spill_map, pt->sb_spill_map_len);
+      munmap(pt->sb_spill_index_map, pt->sb_spill_mapped_lines * sizeof(guint64));
+    }
+
+    close(pt->sb_spill_fd);
+    close(pt->sb_spill_index_fd);
+
+    g_byte_array_free(pt->sb_spill_wbuf, TRUE);
+    g_array_free(pt->sb_spill_wbuf_index, TRUE);
+  }
+
+  g_free(pt->sb_spill_blank);
+  g_free(pt->sb_decoded);
+}
+
 static void fetch_cell(PangoTerm *pt, VTermPos pos, VTermScreenCell *cell)
 {
   if(pos.row < 0) {
@@ -379,14 +1180,14 @@ static void fetch_cell(PangoTerm *pt, VTermPos pos, VTermScreenCell *cell)
       abort();
     }
 
-    /* pos.row == -1 => sb_buffer[0], -2 => [1], etc... */
-    PangoTermScrollbackLine *sb_line = pt->sb_buffer[-pos.row-1];
+    /* pos.row == -1 => line 0, -2 => 1, etc... */
+    PangoTermScrollbackLine *sb_line = sb_line_at(pt, -pos.row-1);
     if(pos.col < sb_line->cols)
-      *cell = sb_line->cells[pos.col];
+      *cell = sb_line_cells(pt, sb_line)[pos.col];
     else {
       *cell = (VTermScreenCell) { { 0 } };
       cell->width = 1;
-      cell->bg = sb_line->cells[sb_line->cols - 1].bg;
+      cell->bg = sb_line->spans[sb_line->n_spans - 1].bg;
     }
   }
   else {
@@ -399,11 +1200,12 @@ static int fetch_is_eol(PangoTerm *pt, VTermPos pos)
   if(pos.row >= 0)
     return vterm_screen_is_eol(pt->vts, pos);
 
-  PangoTermScrollbackLine *sb_line = pt->sb_buffer[-pos.row-1];
+  PangoTermScrollbackLine *sb_line = sb_line_at(pt, -pos.row-1);
+  const VTermScreenCell *cells = sb_line_cells(pt, sb_line);
   for(int col = pos.col; col < sb_line->cols; ) {
-    if(sb_line->cells[col].chars[0])
+    if(cells[col].chars[0])
       return 0;
-    col += sb_line->cells[col].width;
+    col += cells[col].width;
   }
   return 1;
 }
@@ -543,464 +1345,1964 @@ static void lf_to_cr(gchar *str)
 }
 
 /*
- * Repainting operations
+ * Statistics
  */
 
-static void blit_buffer(PangoTerm *pt, cairo_t *gc, int height, int width)
-{
-  cairo_surface_flush(pt->buffer);
+#ifdef DEBUG_ALLOC_COUNT
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
 
-  int whole_width = 2 * CONF_border + pt->cols * pt->cell_width;
-  bool scrollbar = width > (whole_width - CONF_scrollbar_width);
+/* Set while this thread is in a repaint phase */
+static __thread bool alloc_counting;
+static guint64 alloc_count;
 
-  int whole_height;
-  GdkRectangle scrollbar_area;
+void *malloc(size_t size)
+{
+  if(alloc_counting)
+    alloc_count++;
+  return __libc_malloc(size);
+}
 
-  if(scrollbar) {
-    /* Erase old scrollbar */
-    whole_height = pt->rows * pt->cell_height + 2 * CONF_border;
-    scrollbar_area = (GdkRectangle){
-        .x = whole_width - CONF_scrollbar_width,
-        .y = 0,
-        .width = CONF_scrollbar_width,
-        .height = whole_height,
-    };
+void *calloc(size_t nmemb, size_t size)
+{
+  if(alloc_counting)
+    alloc_count++;
+  return __libc_calloc(nmemb, size);
+}
 
-    cairo_save(gc);
+void *realloc(void *ptr, size_t size)
+{
+  if(alloc_counting)
+    alloc_count++;
+  return __libc_realloc(ptr, size);
+}
+#endif
 
-    gdk_cairo_rectangle(gc, &scrollbar_area);
-    cairo_clip(gc);
-    cairo_set_source_rgb(gc,
-        pt->bg_col.red   / 65535.0,
-        pt->bg_col.green / 65535.0,
-        pt->bg_col.blue  / 65535.0);
-    cairo_paint(gc);
+/* Switch to timing a new phase, returning the previous one to switch back to
+ * afterwards */
+static int stats_phase(PangoTerm *pt, int phase)
+{
+  if(!pt->collect_stats)
+    return PHASE_OTHER;
 
-    cairo_restore(gc);
-  }
+  gint64 now = g_get_monotonic_time();
+  int prev = pt->stats.phase;
 
-  {
-    cairo_save(gc);
+  pt->stats.phase_time[prev] += now - pt->stats.phase_start;
+  pt->stats.phase = phase;
+  pt->stats.phase_start = now;
 
-    /* clip rectangle will solve this efficiently */
-    cairo_set_source_surface(gc, pt->buffer, CONF_border, CONF_border);
-    cairo_paint(gc);
+#ifdef DEBUG_ALLOC_COUNT
+  alloc_counting = phase == PHASE_DAMAGE || phase == PHASE_FLUSH || phase == PHASE_BLIT;
+#endif
 
-    cairo_restore(gc);
-  }
+  return prev;
+}
 
-  if(scrollbar && pt->scroll_offs) {
-    /* Map the whole pt->rows + pt->scrollback_current extent onto the entire
-     * height of the window, and draw a brighter rectangle to represent the
-     * part currently visible
-     */
-    int pixels_from_bottom = (whole_height * pt->scroll_offs) /
-                             (pt->rows + pt->scroll_current);
-    int pixels_tall = (whole_height * pt->rows) /
-                      (pt->rows + pt->scroll_current);
+/*
+ * Repainting operations
+ */
 
-    cairo_save(gc);
+static void queue_draw(PangoTerm *pt)
+{
+  if(pt->termda)
+    gtk_widget_queue_draw(pt->termda);
+}
 
-    gdk_cairo_rectangle(gc, &scrollbar_area);
-    cairo_clip(gc);
-    cairo_set_source_rgba(gc,
-        pt->fg_col.red   / 65535.0,
-        pt->fg_col.green / 65535.0,
-        pt->fg_col.blue  / 65535.0,
-        0.3);
-    cairo_paint(gc);
+/* Draw on one row of the buffer, in whole-buffer coordinates */
+static cairo_t *buffer_row_create(PangoTerm *pt, int prow)
+{
+  cairo_t *gc = cairo_create(pt->buffer[prow]);
+  cairo_translate(gc, 0, -prow * pt->cell_height);
 
-    scrollbar_area.height = pixels_tall;
-    scrollbar_area.y = whole_height - pixels_tall - pixels_from_bottom;
-    gdk_cairo_rectangle(gc, &scrollbar_area);
-    cairo_clip(gc);
-    cairo_set_source_rgba(gc,
-        pt->fg_col.red   / 65535.0,
-        pt->fg_col.green / 65535.0,
-        pt->fg_col.blue  / 65535.0,
-        0.7);
-    cairo_paint(gc);
+  return gc;
+}
 
-    cairo_restore(gc);
-  }
+/* Where the scrollbar goes, if the window is wide enough for one */
+static bool get_scrollbar_area(PangoTerm *pt, int width, GdkRectangle *area)
+{
+  int whole_width = 2 * CONF_border + pt->cols * pt->cell_width;
+  if(width <= (whole_width - CONF_scrollbar_width))
+    return false;
+
+  *area = (GdkRectangle){
+      .x = whole_width - CONF_scrollbar_width,
+      .y = 0,
+      .width = CONF_scrollbar_width,
+      .height = pt->rows * pt->cell_height + 2 * CONF_border,
+  };
+  return true;
+}
+
+static void erase_scrollbar(PangoTerm *pt, cairo_t *gc, const GdkRectangle *scrollbar_area)
+{
+  cairo_save(gc);
+
+  gdk_cairo_rectangle(gc, scrollbar_area);
+  cairo_clip(gc);
+  cairo_set_source_rgb(gc,
+      pt->bg_col.red   / 65535.0,
+      pt->bg_col.green / 65535.0,
+      pt->bg_col.blue  / 65535.0);
+  cairo_paint(gc);
+
+  cairo_restore(gc);
+}
+
+static void draw_scrollbar(PangoTerm *pt, cairo_t *gc, const GdkRectangle *area)
+{
+  if(!pt->scroll_offs)
+    return;
+
+  GdkRectangle scrollbar_area = *area;
+  int whole_height = scrollbar_area.height;
+
+  /* Map the whole pt->rows + pt->scrollback_current extent onto the entire
+   * height of the window, and draw a brighter rectangle to represent the
+   * part currently visible
+   */
+  /* Spilled history can run to millions of lines, enough to overflow an int */
+  gint64 whole_lines = (gint64)pt->rows + pt->scroll_current;
+  int pixels_from_bottom = ((gint64)whole_height * pt->scroll_offs) / whole_lines;
+  int pixels_tall = ((gint64)whole_height * pt->rows) / whole_lines;
+
+  cairo_save(gc);
+
+  gdk_cairo_rectangle(gc, &scrollbar_area);
+  cairo_clip(gc);
+  cairo_set_source_rgba(gc,
+      pt->fg_col.red   / 65535.0,
+      pt->fg_col.green / 65535.0,
+      pt->fg_col.blue  / 65535.0,
+      0.3);
+  cairo_paint(gc);
+
+  scrollbar_area.height = pixels_tall;
+  scrollbar_area.y = whole_height - pixels_tall - pixels_from_bottom;
+  gdk_cairo_rectangle(gc, &scrollbar_area);
+  cairo_clip(gc);
+  cairo_set_source_rgba(gc,
+      pt->fg_col.red   / 65535.0,
+      pt->fg_col.green / 65535.0,
+      pt->fg_col.blue  / 65535.0,
+      0.7);
+  cairo_paint(gc);
+
+  cairo_restore(gc);
+}
 
 #ifdef DEBUG_SHOW_LINECONTINUATION
-  {
-    cairo_save(gc);
+static void draw_linecontinuation(PangoTerm *pt, cairo_t *gc)
+{
+  cairo_save(gc);
 
-    cairo_set_source_rgba(gc,
-        0.0, 1.0, 0.0,
-        0.6);
+  cairo_set_source_rgba(gc,
+      0.0, 1.0, 0.0,
+      0.6);
 
-    VTermState *state = vterm_obtain_state(pt->vt);
+  VTermState *state = vterm_obtain_state(pt->vt);
 
-    PhyPos ph_pos = { .pcol = pt->cols - 1 };
-    for(ph_pos.prow = 1; ph_pos.prow < pt->rows; ph_pos.prow++) {
-      VTermPos pos = VTERMPOS_FROM_PHYSPOS(pt, ph_pos);
-      if(pos.row < 1)
-        continue;
+  PhyPos ph_pos = { .pcol = pt->cols - 1 };
+  for(ph_pos.prow = 1; ph_pos.prow < pt->rows; ph_pos.prow++) {
+    VTermPos pos = VTERMPOS_FROM_PHYSPOS(pt, ph_pos);
+    if(pos.row < 1)
+      continue;
 
-      const VTermLineInfo *lineinfo = vterm_state_get_lineinfo(state, pos.row + 1);
-      if(!lineinfo->continuation)
-        continue;
+    const VTermLineInfo *lineinfo = vterm_state_get_lineinfo(state, pos.row + 1);
+    if(!lineinfo->continuation)
+      continue;
 
-      GdkRectangle rect = GDKRECTANGLE_FROM_PHYPOS_CELLS(pt, ph_pos, 1);
-      cairo_rectangle(gc,
-          rect.x + 1, rect.y + 2, rect.width - 2, rect.height - 4);
+    GdkRectangle rect = GDKRECTANGLE_FROM_PHYPOS_CELLS(pt, ph_pos, 1);
+    cairo_rectangle(gc,
+        rect.x + 1, rect.y + 2, rect.width - 2, rect.height - 4);
+    cairo_fill(gc);
+  }
+
+  cairo_restore(gc);
+}
+#endif
+
+static bool row_is_dwl(PangoTerm *pt, int prow)
+{
+  PhyPos ph_pos = { .prow = prow, .pcol = 0 };
+  VTermPos pos = VTERMPOS_FROM_PHYSPOS(pt, ph_pos);
+
+  VTermScreenCell cell;
+  fetch_cell(pt, pos, &cell);
+  return cell.attrs.dwl;
+}
+
+/* The selection as rectangles of the buffer, clipped to what's visible.
+ * Rows of DECDWL/DECDHL lines get their own, twice as wide, so there can be
+ * as many as there are rows. Returns how many */
+static int selection_rects(PangoTerm *pt, GdkRectangle rects[])
+{
+  if(!pt->highlight_valid)
+    return 0;
+
+  VTermPos start = pt->highlight_start,
+           stop  = pt->highlight_stop;
+
+  VTermRect flow[3];
+  int n_flow = 0;
+
+  if(start.row == stop.row)
+    flow[n_flow++] = (VTermRect){
+      .start_row = start.row, .end_row = start.row + 1,
+      .start_col = start.col, .end_col = stop.col + 1,
+    };
+  else {
+    flow[n_flow++] = (VTermRect){
+      .start_row = start.row, .end_row = start.row + 1,
+      .start_col = start.col, .end_col = pt->cols,
+    };
+    if(start.row + 1 < stop.row)
+      flow[n_flow++] = (VTermRect){
+        .start_row = start.row + 1, .end_row = stop.row,
+        .start_col = 0,             .end_col = pt->cols,
+      };
+    flow[n_flow++] = (VTermRect){
+      .start_row = stop.row, .end_row = stop.row + 1,
+      .start_col = 0,        .end_col = stop.col + 1,
+    };
+  }
+
+  int n_rects = 0;
+  for(int i = 0; i < n_flow; i++) {
+    PhyRect ph_rect = PHYRECT_FROM_VTERMRECT(pt, flow[i]);
+    if(ph_rect.start_prow < 0)
+      ph_rect.start_prow = 0;
+    if(ph_rect.end_prow > pt->rows)
+      ph_rect.end_prow = pt->rows;
+    if(ph_rect.end_pcol > pt->cols)
+      ph_rect.end_pcol = pt->cols;
+
+    if(ph_rect.start_prow >= ph_rect.end_prow || ph_rect.start_pcol >= ph_rect.end_pcol)
+      continue;
+
+    for(int prow = ph_rect.start_prow; prow < ph_rect.end_prow; ) {
+      bool dwl = row_is_dwl(pt, prow);
+
+      PhyRect run = ph_rect;
+      run.start_prow = prow;
+      for(prow++; prow < ph_rect.end_prow && row_is_dwl(pt, prow) == dwl; prow++)
+        ;
+      run.end_prow = prow;
+
+      GdkRectangle rect = GDKRECTANGLE_FROM_PHYRECT(pt, run);
+      if(dwl) {
+        rect.x *= 2, rect.width *= 2;
+        if(rect.x + rect.width > pt->cols * pt->cell_width)
+          rect.width = pt->cols * pt->cell_width - rect.x;
+        if(rect.width <= 0)
+          continue;
+      }
+
+      rects[n_rects++] = rect;
+    }
+  }
+
+  return n_rects;
+}
+
+static bool cursor_area(PangoTerm *pt, GdkRectangle *area, VTermScreenCell *cell);
+static void draw_cursor(PangoTerm *pt, cairo_t *gc, const GdkRectangle *area, const VTermScreenCell *cell);
+
+static void blit_buffer(PangoTerm *pt, cairo_t *gc, int height, int width)
+{
+  int prev_phase = stats_phase(pt, PHASE_BLIT);
+
+  GdkRectangle scrollbar_area;
+  bool scrollbar = get_scrollbar_area(pt, width, &scrollbar_area);
+
+  if(scrollbar)
+    /* Erase old scrollbar */
+    erase_scrollbar(pt, gc, &scrollbar_area);
+
+  {
+    cairo_save(gc);
+
+    /* clip rectangle will solve this efficiently */
+    for(int row = 0; row < pt->n_buffer_rows; row++) {
+      int y = CONF_border + row * pt->cell_height;
+
+      cairo_surface_flush(pt->buffer[row]);
+      cairo_set_source_surface(gc, pt->buffer[row], CONF_border, y);
+      cairo_rectangle(gc, CONF_border, y, pt->cols * pt->cell_width, pt->cell_height);
       cairo_fill(gc);
     }
 
     cairo_restore(gc);
   }
+
+  if(scrollbar)
+    draw_scrollbar(pt, gc, &scrollbar_area);
+
+#ifdef DEBUG_SHOW_LINECONTINUATION
+  draw_linecontinuation(pt, gc);
 #endif
 
+  stats_phase(pt, prev_phase);
 }
 
-static void blit_dirty(PangoTerm *pt)
+/* Reallocate for the current size, with everything dirty */
+static void dirty_rows_resize(PangoTerm *pt)
 {
-  if(!pt->dirty_area.height || !pt->dirty_area.width)
-    return;
+  for(int row = 0; row < pt->n_dirty_rows; row++)
+    g_clear_pointer(&pt->row_nodes[row], gsk_render_node_unref);
 
-  gtk_widget_queue_draw(pt->termda);
+  pt->n_dirty_rows = pt->rows;
+  pt->dirty_rows = g_realloc_n(pt->dirty_rows, pt->rows, sizeof(pt->dirty_rows[0]));
+  pt->row_nodes = g_realloc_n(pt->row_nodes, pt->rows, sizeof(pt->row_nodes[0]));
 
-  /*
-  blit_buffer(pt, &(GdkRectangle){
-      .x      = pt->dirty_area.x + CONF_border,
-      .y      = pt->dirty_area.y + CONF_border,
-      .width  = pt->dirty_area.width,
-      .height = pt->dirty_area.height,
-  });
-  */
+  for(int row = 0; row < pt->n_dirty_rows; row++) {
+    pt->dirty_rows[row].x0 = 0;
+    pt->dirty_rows[row].x1 = pt->cols * pt->cell_width;
+    pt->row_nodes[row] = NULL;
+  }
 
-  pt->dirty_area.width  = 0;
-  pt->dirty_area.height = 0;
+  pt->dirty = true;
 }
 
-static void flush_pending(PangoTerm *pt)
+/* Note that area of the buffer has changed */
+static void mark_dirty(PangoTerm *pt, const GdkRectangle *area)
 {
-  if(!pt->pending_area.width)
+  if(!area->width || !area->height)
     return;
 
-  cairo_t* gc = cairo_create(pt->buffer);
-  GdkRectangle pending_area = pt->pending_area;
-  int glyphs_x = pending_area.x;
-  int glyphs_y = pending_area.y;
+  int start_row = area->y / pt->cell_height;
+  int end_row   = (area->y + area->height + pt->cell_height - 1) / pt->cell_height;
 
-  if(pt->pen.attrs.dwl)
-    cairo_scale(gc, 2.0, 1.0);
+  if(start_row < 0)
+    start_row = 0;
+  if(end_row > pt->n_dirty_rows)
+    end_row = pt->n_dirty_rows;
 
-  if(pt->pen.attrs.dhl) {
-    cairo_scale(gc, 1.0, 2.0);
-    pending_area.y /= 2;
-    pending_area.height /= 2;
-    glyphs_y = pending_area.y;
+  for(int row = start_row; row < end_row; row++) {
+    if(pt->dirty_rows[row].x0 >= pt->dirty_rows[row].x1) {
+      pt->dirty_rows[row].x0 = area->x;
+      pt->dirty_rows[row].x1 = area->x + area->width;
+      continue;
+    }
 
-    if(pt->pen.attrs.dhl == 2)
-      glyphs_y -= pending_area.height;
+    if(area->x < pt->dirty_rows[row].x0)
+      pt->dirty_rows[row].x0 = area->x;
+    if(area->x + area->width > pt->dirty_rows[row].x1)
+      pt->dirty_rows[row].x1 = area->x + area->width;
   }
 
-  /* Background fill */
-  {
-    cairo_save(gc);
+  pt->dirty = true;
+}
 
-    gdk_cairo_rectangle(gc, &pending_area);
+static void blit_dirty(PangoTerm *pt)
+{
+  if(!pt->dirty)
+    return;
+
+  if(pt->headless_target) {
+    /* The buffer covers the cursor where it was, to be drawn again on top */
+    mark_dirty(pt, &pt->cursor_drawn);
+
+    /* Inverting isn't idempotent, so the whole selection is blitted afresh
+     * each time, as well as wherever it used to be */
+    GdkRectangle selection[pt->rows];
+    int n_selection = selection_rects(pt, selection);
+
+    for(int i = 0; i < pt->n_selection_drawn; i++)
+      mark_dirty(pt, &pt->selection_drawn[i]);
+    for(int i = 0; i < n_selection; i++)
+      mark_dirty(pt, &selection[i]);
+
+    /* Nothing else draws on the target, so only what changed needs copying.
+     * Consecutive rows with the same span make one rectangle */
+    cairo_t *gc = cairo_create(pt->headless_target);
+
+    for(int row = 0; row < pt->n_dirty_rows; ) {
+      int x0 = pt->dirty_rows[row].x0, x1 = pt->dirty_rows[row].x1;
+      if(x0 >= x1) {
+        row++;
+        continue;
+      }
+
+      int end_row = row + 1;
+      while(end_row < pt->n_dirty_rows &&
+          pt->dirty_rows[end_row].x0 == x0 && pt->dirty_rows[end_row].x1 == x1)
+        end_row++;
+
+      cairo_rectangle(gc,
+          CONF_border + x0, CONF_border + row * pt->cell_height,
+          x1 - x0, (end_row - row) * pt->cell_height);
+      row = end_row;
+    }
     cairo_clip(gc);
 
-    GdkRGBA bg = pt->pen.attrs.reverse ? pt->pen.fg_col : pt->pen.bg_col;
-    gdk_cairo_set_source_rgba(gc, &bg);
-    cairo_paint(gc);
+    blit_buffer(pt,
+        gc,
+        cairo_image_surface_get_width(pt->headless_target),
+        cairo_image_surface_get_height(pt->headless_target));
+    cairo_destroy(gc);
 
-    cairo_restore(gc);
+    if(n_selection) {
+      gc = cairo_create(pt->headless_target);
+      cairo_translate(gc, CONF_border, CONF_border);
+      cairo_set_operator(gc, CAIRO_OPERATOR_DIFFERENCE);
+      cairo_set_source_rgb(gc, 1.0, 1.0, 1.0);
+      for(int i = 0; i < n_selection; i++)
+        gdk_cairo_rectangle(gc, &selection[i]);
+      cairo_fill(gc);
+      cairo_destroy(gc);
+    }
+
+    pt->selection_drawn = g_renew(GdkRectangle, pt->selection_drawn, n_selection);
+    memcpy(pt->selection_drawn, selection, n_selection * sizeof(selection[0]));
+    pt->n_selection_drawn = n_selection;
+
+    VTermScreenCell cell;
+    if(cursor_area(pt, &pt->cursor_drawn, &cell)) {
+      gc = cairo_create(pt->headless_target);
+      cairo_translate(gc, CONF_border, CONF_border);
+      draw_cursor(pt, gc, &pt->cursor_drawn, &cell);
+      cairo_destroy(gc);
+    }
+    else
+      pt->cursor_drawn.width = 0;
+  }
+  else {
+    /* A window can't be clipped like the headless target; GTK re-records
+     * the whole widget. Instead the rows that didn't change keep their
+     * nodes, and GTK only composites again what differs from last frame */
+    for(int row = 0; row < pt->n_dirty_rows; row++)
+      if(pt->dirty_rows[row].x0 < pt->dirty_rows[row].x1)
+        g_clear_pointer(&pt->row_nodes[row], gsk_render_node_unref);
+
+    queue_draw(pt);
   }
 
-  if(pt->glyphs->len) {
-    PangoLayout *layout = pt->pen.layout;
+  for(int row = 0; row < pt->n_dirty_rows; row++)
+    pt->dirty_rows[row].x0 = pt->dirty_rows[row].x1 = 0;
 
-    pango_layout_set_text(layout, pt->glyphs->str, pt->glyphs->len);
+  pt->dirty = false;
+}
 
-    if(pt->pen.pangoattrs)
-      pango_layout_set_attributes(layout, pt->pen.pangoattrs);
+/* Move whole rows of the buffer by delta rows into the destination, by
+ * rotating the strips. The rows left behind get the strips that were
+ * overwritten, so their pixels are garbage until repainted */
+static void buffer_rows_move(PangoTerm *pt, int start_prow, int end_prow, int delta)
+{
+  int first = MIN(start_prow, start_prow - delta);
+  int n     = end_prow - start_prow + abs(delta);
+  int by    = delta > 0 ? delta : n + delta;
+
+  /* Rotating right by reversing the whole then each part needs no scratch */
+  cairo_surface_t **strips = pt->buffer + first;
+  for(int pass = 0; pass < 3; pass++) {
+    int lo = pass == 2 ? by : 0;
+    int hi = pass == 0 ? n : pass == 1 ? by : n;
+
+    for(hi--; lo < hi; lo++, hi--) {
+      cairo_surface_t *tmp = strips[lo];
+      strips[lo] = strips[hi];
+      strips[hi] = tmp;
+    }
+  }
+}
 
-    // Now adjust all the widths
-    PangoLayoutIter *iter = pango_layout_get_iter(layout);
-    do {
-      PangoLayoutRun *run = pango_layout_iter_get_run(iter);
-      if(!run)
-        continue;
+/* A colour as an RGB24 pixel, rounded the same way cairo does */
+static guint32 buffer_pixel(const GdkRGBA *col)
+{
+#define CHANNEL(c) ((guint32)(CLAMP((c), 0.0, 1.0) * 65535.0 + 0.5) >> 8)
+  return 0xff000000 | CHANNEL(col->red) << 16 | CHANNEL(col->green) << 8 | CHANNEL(col->blue);
+#undef CHANNEL
+}
 
-      PangoGlyphString *glyph_str = run->glyphs;
-      int i;
-      for(i = 0; i < glyph_str->num_glyphs; i++) {
-        PangoGlyphInfo *glyph = &glyph_str->glyphs[i];
-        int str_index = run->item->offset + glyph_str->log_clusters[i];
-        int char_width = g_array_index(pt->glyph_widths, int, str_index);
-        if(glyph->geometry.width && glyph->geometry.width != char_width * pt->cell_width_pango) {
-          /* Adjust its x_offset to match the width change, to ensure it still
-           * remains centered in the cell */
-          glyph->geometry.x_offset -= (glyph->geometry.width - char_width * pt->cell_width_pango) / 2;
-          glyph->geometry.width = char_width * pt->cell_width_pango;
-        }
-      }
-    } while(pango_layout_iter_next_run(iter));
+/* Fill area, which must lie within one row, with a solid pixel by writing
+ * straight into the strip. Runs of blank cells in many colours would
+ * otherwise be a clip and paint each */
+static void buffer_fill_span(PangoTerm *pt, const GdkRectangle *area, guint32 pixel)
+{
+  int prow = area->y / pt->cell_height;
+  cairo_surface_t *strip = pt->buffer[prow];
+  int scale = pt->buffer_scale;
 
-    pango_layout_iter_free(iter);
+  int x = area->x * scale;
+  int y = (area->y - prow * pt->cell_height) * scale;
+  int width = MIN(area->width * scale, cairo_image_surface_get_width(strip) - x);
+  int height = area->height * scale;
 
-    /* Draw glyphs */
-    GdkRGBA fg = pt->pen.attrs.reverse ? pt->pen.bg_col : pt->pen.fg_col;
+  cairo_surface_flush(strip);
 
-    gdk_cairo_set_source_rgba(gc, &fg);
-    cairo_move_to(gc, glyphs_x, glyphs_y);
-    pango_cairo_show_layout(gc, layout);
+  int stride = cairo_image_surface_get_stride(strip);
+  unsigned char *data = cairo_image_surface_get_data(strip) + y * stride + x * 4;
 
-    g_string_truncate(pt->glyphs, 0);
+#ifdef __SSE2__
+  const __m128i pixels = _mm_set1_epi32(pixel);
+#endif
+
+  for(int line = 0; line < height; line++, data += stride) {
+    guint32 *dst = (guint32 *)data;
+    int i = 0;
+
+#ifdef __SSE2__
+    for(; i + 8 <= width; i += 8) {
+      _mm_storeu_si128((__m128i *)(dst + i),     pixels);
+      _mm_storeu_si128((__m128i *)(dst + i + 4), pixels);
+    }
+    for(; i + 4 <= width; i += 4)
+      _mm_storeu_si128((__m128i *)(dst + i), pixels);
+#endif
+
+    for(; i < width; i++)
+      dst[i] = pixel;
   }
 
-  if(pt->pen.attrs.dwl)
-    pt->pending_area.x *= 2, pt->pending_area.width *= 2;
+  cairo_surface_mark_dirty_rectangle(strip, x, y, width, height);
+}
 
-  if(pt->dirty_area.width && pt->pending_area.height)
-    gdk_rectangle_union(&pt->pending_area, &pt->dirty_area, &pt->dirty_area);
-  else
-    pt->dirty_area = pt->pending_area;
+/* Copy part of the buffer that isn't whole rows. The strips are all image
+ * surfaces of the same size, so this is a memmove per pixel row; rows are
+ * visited in the order that keeps overlapping sources intact */
+static void buffer_copy_rect(PangoTerm *pt, PhyRect dest, int drow, int dcol)
+{
+  int step = drow > 0 ? -1 : 1;
+  int first = drow > 0 ? dest.end_prow - 1 : dest.start_prow;
+
+  int scale = pt->buffer_scale;
+  int x      = dest.start_pcol * pt->cell_width * scale;
+  int src_x  = (dest.start_pcol - dcol) * pt->cell_width * scale;
+  int width  = (dest.end_pcol - dest.start_pcol) * pt->cell_width * scale;
+  int height = pt->cell_height * scale;
+
+  for(int prow = first; prow >= dest.start_prow && prow < dest.end_prow; prow += step) {
+    int src_prow = prow - drow;
+    if(src_prow < 0 || src_prow >= pt->n_buffer_rows)
+      continue;
 
-  pt->pending_area.width = 0;
-  pt->pending_area.height = 0;
-  pt->erase_columns = 0;
+    cairo_surface_t *src = pt->buffer[src_prow], *dst = pt->buffer[prow];
+    cairo_surface_flush(src);
+    cairo_surface_flush(dst);
 
-  cairo_destroy(gc);
+    int stride = cairo_image_surface_get_stride(dst);
+    unsigned char *dst_data = cairo_image_surface_get_data(dst) + x * 4;
+    unsigned char *src_data = cairo_image_surface_get_data(src) + src_x * 4;
+
+    for(int y = 0; y < height; y++)
+      memmove(dst_data + y * stride, src_data + y * stride, width * 4);
+
+    cairo_surface_mark_dirty_rectangle(dst, x, 0, width, height);
+  }
 }
 
-static void put_glyph(PangoTerm *pt, const uint32_t chars[], int width, VTermPos pos)
+/* Whole rows of the buffer have been copied by delta rows into the
+ * destination. Their nodes and dirty spans move with them, so GTK only has to
+ * redraw the rows in new places */
+static void row_nodes_move(PangoTerm *pt, int start_prow, int end_prow, int delta)
 {
-  PhyPos ph_pos = PHYSPOS_FROM_VTERMPOS(pt, pos);
-  if(ph_pos.prow < 0 || ph_pos.prow >= pt->rows)
+  int src_start = start_prow - delta, src_end = end_prow - delta;
+
+  for(int row = start_prow; row < end_prow; row++)
+    if(row < src_start || row >= src_end)
+      g_clear_pointer(&pt->row_nodes[row], gsk_render_node_unref);
+
+  memmove(pt->row_nodes + start_prow, pt->row_nodes + src_start,
+      (end_prow - start_prow) * sizeof(pt->row_nodes[0]));
+  memmove(pt->dirty_rows + start_prow, pt->dirty_rows + src_start,
+      (end_prow - start_prow) * sizeof(pt->dirty_rows[0]));
+
+  /* The rows left behind still hold their old pixels; just make them again */
+  for(int row = src_start; row < src_end; row++)
+    if(row < start_prow || row >= end_prow) {
+      pt->row_nodes[row] = NULL;
+      pt->dirty_rows[row].x0 = pt->dirty_rows[row].x1 = 0;
+    }
+
+  queue_draw(pt);
+}
+
+/* Force each glyph to the width of the cells it occupies, keeping it centred.
+ * widths gives the cell width for each byte offset into the text */
+static void fix_glyph_widths(PangoTerm *pt, PangoLayout *layout, const int *widths)
+{
+  PangoLayoutIter *iter = pango_layout_get_iter(layout);
+  do {
+    PangoLayoutRun *run = pango_layout_iter_get_run(iter);
+    if(!run)
+      continue;
+
+    PangoGlyphString *glyph_str = run->glyphs;
+    int i;
+    for(i = 0; i < glyph_str->num_glyphs; i++) {
+      PangoGlyphInfo *glyph = &glyph_str->glyphs[i];
+      int str_index = run->item->offset + glyph_str->log_clusters[i];
+      int char_width = widths[str_index];
+      if(glyph->geometry.width && glyph->geometry.width != char_width * pt->cell_width_pango) {
+        /* Adjust its x_offset to match the width change, to ensure it still
+         * remains centered in the cell */
+        glyph->geometry.x_offset -= (glyph->geometry.width - char_width * pt->cell_width_pango) / 2;
+        glyph->geometry.width = char_width * pt->cell_width_pango;
+      }
+    }
+  } while(pango_layout_iter_next_run(iter));
+
+  pango_layout_iter_free(iter);
+}
+
+static void flush_pending(PangoTerm *pt);
+
+static void glyph_atlas_free(PangoTerm *pt)
+{
+  if(!pt->atlas.surface)
     return;
 
-  GdkRectangle destarea = GDKRECTANGLE_FROM_PHYPOS_CELLS(pt, ph_pos, width);
+  for(int i = 0; i < pt->atlas.n_used; i++)
+    if(pt->atlas.slots[i].mask)
+      cairo_surface_destroy(pt->atlas.slots[i].mask);
 
-  if(pt->erase_columns)
-    flush_pending(pt);
-  if(destarea.y != pt->pending_area.y || destarea.x != pt->pending_area.x + pt->pending_area.width)
-    flush_pending(pt);
+  g_hash_table_destroy(pt->atlas.glyphs);
+  g_free(pt->atlas.slots);
+  g_object_unref(pt->atlas.layout);
+  cairo_surface_destroy(pt->atlas.surface);
+
+  pt->atlas.surface = NULL;
+  pt->atlas.n_slots = 0;
+}
+
+/* Glyphs are rasterized at the buffer's scale, so they stay sharp when masked
+ * onto it */
+static cairo_surface_t *glyph_atlas_surface_new(PangoTerm *pt)
+{
+  int scale = pt->buffer_scale;
+
+  cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_A8,
+      ATLAS_SIZE * scale, ATLAS_SIZE * scale);
+  cairo_surface_set_device_scale(surface, scale, scale);
+
+  return surface;
+}
+
+/* Size the atlas for the current cell size */
+static void glyph_atlas_init(PangoTerm *pt, PangoContext *pctx, PangoFontDescription *fontdesc)
+{
+  /* Pending glyphs may point into the old atlas */
+  flush_pending(pt);
+  glyph_atlas_free(pt);
+
+  pt->atlas.pad_x = pt->cell_width / 2;
+  pt->atlas.pad_y = pt->cell_height / 4;
+  pt->atlas.slot_width  = 2 * pt->cell_width + 2 * pt->atlas.pad_x;
+  pt->atlas.slot_height = pt->cell_height + 2 * pt->atlas.pad_y;
+
+  pt->atlas.per_row = ATLAS_SIZE / pt->atlas.slot_width;
+  pt->atlas.n_slots = pt->atlas.per_row * (ATLAS_SIZE / pt->atlas.slot_height);
+  pt->atlas.n_used  = 0;
+
+  /* Absurdly large fonts just go through Pango every time */
+  if(!pt->atlas.n_slots)
+    return;
+
+  pt->atlas.surface = glyph_atlas_surface_new(pt);
+  pt->atlas.slots   = g_new(PangoTermGlyph, pt->atlas.n_slots);
+  pt->atlas.glyphs  = g_hash_table_new(g_int64_hash, g_int64_equal);
+
+  pt->atlas.layout = pango_layout_new(pctx);
+  pango_layout_set_font_description(pt->atlas.layout, fontdesc);
+}
+
+/* Forget every glyph once the atlas is full */
+static void glyph_atlas_reset(PangoTerm *pt)
+{
+  flush_pending(pt);
+
+  for(int i = 0; i < pt->atlas.n_used; i++)
+    if(pt->atlas.slots[i].mask)
+      cairo_surface_destroy(pt->atlas.slots[i].mask);
+
+  g_hash_table_remove_all(pt->atlas.glyphs);
+  pt->atlas.n_used = 0;
+
+  /* Also used to start again at a new scale */
+  double scale;
+  cairo_surface_get_device_scale(pt->atlas.surface, &scale, NULL);
+  if(scale != pt->buffer_scale) {
+    cairo_surface_destroy(pt->atlas.surface);
+    pt->atlas.surface = glyph_atlas_surface_new(pt);
+  }
+  else {
+    cairo_t *cr = cairo_create(pt->atlas.surface);
+    cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+  }
+
+  pt->stats.atlas_resets++;
+}
+
+/* Whether a cell can come from the atlas with the current pen */
+static bool glyph_atlas_usable(PangoTerm *pt, const uint32_t chars[])
+{
+  if(!pt->atlas.n_slots || chars[1])
+    return false;
+
+  /* Pango draws the decorations across the whole run */
+  if(pt->pen.attrs.underline || pt->pen.attrs.strike ||
+     pt->pen.attrs.dwl || pt->pen.attrs.dhl)
+    return false;
+
+  /* Anything that might be a colour emoji would lose its colour as a mask */
+  uint32_t c = chars[0];
+  if((c >= 0x2300 && c < 0x2400) ||
+     (c >= 0x2600 && c < 0x27c0) ||
+     (c >= 0x2b00 && c < 0x2c00) ||
+     c >= 0x1f000)
+    return false;
+
+  return true;
+}
+
+/* The glyph a cell can be drawn with from the ASCII table, or 0 */
+static PangoGlyph ascii_glyph(PangoTerm *pt, const PangoTermPenAttrs *attrs, const uint32_t chars[], int width)
+{
+  if(width != 1 || chars[1] || chars[0] < ASCII_FIRST || chars[0] >= ASCII_FIRST + ASCII_COUNT)
+    return 0;
+
+  if(attrs->underline || attrs->strike || attrs->dwl || attrs->dhl)
+    return 0;
+
+  if(attrs->font && attrs->font < pt->n_fonts)
+    return 0;
+
+  int variant = ASCII_VARIANT(*attrs);
+  if(!pt->ascii.font[variant])
+    return 0;
+
+  return pt->ascii.glyph[variant][chars[0] - ASCII_FIRST];
+}
+
+static PangoTermGlyph *glyph_atlas_get(PangoTerm *pt, uint32_t c, int width)
+{
+  guint64 key = GLYPH_KEY(c, width, pt->pen.attrs);
+
+  PangoTermGlyph *glyph = g_hash_table_lookup(pt->atlas.glyphs, &key);
+  if(glyph) {
+    pt->stats.atlas_hits++;
+    return glyph;
+  }
+
+  pt->stats.atlas_misses++;
+
+  if(pt->atlas.n_used == pt->atlas.n_slots)
+    glyph_atlas_reset(pt);
+
+  int slot = pt->atlas.n_used++;
+  int x = (slot % pt->atlas.per_row) * pt->atlas.slot_width;
+  int y = (slot / pt->atlas.per_row) * pt->atlas.slot_height;
+
+  glyph = &pt->atlas.slots[slot];
+  glyph->key   = key;
+  glyph->width = width;
+  glyph->mask  = NULL;
+
+  char str[6];
+  int len = g_unichar_to_utf8(c, str);
+  int widths[6];
+  for(int i = 0; i < len; i++)
+    widths[i] = width;
+
+  /* The pen's attributes are the ones the key was made from */
+  PangoLayout *layout = pt->atlas.layout;
+  pango_layout_set_text(layout, str, len);
+  pango_layout_set_attributes(layout, pt->pen.pangoattrs);
+
+  PangoRectangle ink;
+  pango_layout_get_pixel_extents(layout, &ink, NULL);
+
+  if(ink.width && ink.height) {
+    fix_glyph_widths(pt, layout, widths);
+
+    cairo_t *cr = cairo_create(pt->atlas.surface);
+    cairo_rectangle(cr, x, y, pt->atlas.slot_width, pt->atlas.slot_height);
+    cairo_clip(cr);
+    cairo_move_to(cr, x + pt->atlas.pad_x, y + pt->atlas.pad_y);
+    pango_cairo_show_layout(cr, layout);
+    cairo_destroy(cr);
+
+    glyph->mask = cairo_surface_create_for_rectangle(pt->atlas.surface,
+        x, y, pt->atlas.slot_width, pt->atlas.slot_height);
+  }
+
+  g_hash_table_insert(pt->atlas.glyphs, &glyph->key, glyph);
+
+  return glyph;
+}
+
+static void shaped_run_free(gpointer data)
+{
+  PangoTermShapedRun *run = data;
+
+  for(int i = 0; i < run->n_items; i++) {
+    g_object_unref(run->items[i].font);
+    pango_glyph_string_free(run->items[i].glyphs);
+  }
+
+  g_free(run);
+}
+
+/* Shape the pending glyphs, or find them already shaped. Only valid for runs
+ * without underline or strikethrough, which a glyph string can't draw */
+static const PangoTermShapedRun *shaped_run_get(PangoTerm *pt)
+{
+  GString *key = pt->run_cache_key;
+
+  g_string_truncate(key, 0);
+  g_string_append_c(key, '0' + (pt->pen.attrs.bold | pt->pen.attrs.italic << 1));
+  g_string_append_c(key, 'a' + pt->pen.attrs.font);
+  g_string_append_len(key, pt->glyphs->str, pt->glyphs->len);
+  g_string_append_c(key, '\x01');
+  for(const char *s = pt->glyphs->str; s < pt->glyphs->str + pt->glyphs->len; s = g_utf8_next_char(s))
+    g_string_append_c(key, '0' + g_array_index(pt->glyph_widths, int, s - pt->glyphs->str));
+
+  PangoTermShapedRun *run = g_hash_table_lookup(pt->run_cache, key->str);
+  if(run) {
+    pt->stats.run_hits++;
+    return run;
+  }
+
+  pt->stats.run_misses++;
+
+  if(g_hash_table_size(pt->run_cache) >= CONF_run_cache_size)
+    g_hash_table_remove_all(pt->run_cache);
+
+  PangoLayout *layout = pt->pen.layout;
+
+  pango_layout_set_text(layout, pt->glyphs->str, pt->glyphs->len);
+
+  if(pt->pen.pangoattrs)
+    pango_layout_set_attributes(layout, pt->pen.pangoattrs);
+
+  fix_glyph_widths(pt, layout, (int *)pt->glyph_widths->data);
+
+  int n_items = 0;
+  PangoLayoutIter *iter = pango_layout_get_iter(layout);
+  do {
+    if(pango_layout_iter_get_run(iter))
+      n_items++;
+  } while(pango_layout_iter_next_run(iter));
+  pango_layout_iter_free(iter);
+
+  run = g_malloc(sizeof(PangoTermShapedRun) + n_items * sizeof(PangoTermShapedItem));
+  run->n_items = 0;
+
+  /* Positions come from the adjusted widths, as the layout renderer does */
+  int x = 0;
+  iter = pango_layout_get_iter(layout);
+  do {
+    PangoLayoutRun *layout_run = pango_layout_iter_get_run(iter);
+    if(!layout_run)
+      continue;
+
+    PangoTermShapedItem *item = &run->items[run->n_items++];
+    item->font     = g_object_ref(layout_run->item->analysis.font);
+    item->glyphs   = pango_glyph_string_copy(layout_run->glyphs);
+    item->x        = x;
+    item->baseline = pango_layout_iter_get_baseline(iter);
+
+    x += pango_glyph_string_get_width(layout_run->glyphs);
+  } while(pango_layout_iter_next_run(iter));
+  pango_layout_iter_free(iter);
+
+  g_hash_table_insert(pt->run_cache, g_strdup(key->str), run);
+
+  return run;
+}
+
+static void flush_pending(PangoTerm *pt)
+{
+  if(!pt->pending_area.width)
+    return;
+
+  int prev_phase = stats_phase(pt, PHASE_FLUSH);
+
+  cairo_t* gc = buffer_row_create(pt, pt->pending_area.y / pt->cell_height);
+  GdkRectangle pending_area = pt->pending_area;
+  int glyphs_x = pending_area.x;
+  int glyphs_y = pending_area.y;
+
+  if(pt->pen.attrs.dwl)
+    cairo_scale(gc, 2.0, 1.0);
+
+  if(pt->pen.attrs.dhl) {
+    cairo_scale(gc, 1.0, 2.0);
+    pending_area.y /= 2;
+    pending_area.height /= 2;
+    glyphs_y = pending_area.y;
+
+    if(pt->pen.attrs.dhl == 2)
+      glyphs_y -= pending_area.height;
+  }
+
+  /* Background fill */
+  if(!pt->pen.attrs.dwl && !pt->pen.attrs.dhl)
+    buffer_fill_span(pt, &pending_area, pt->pen.style->bg_pixel);
+  else {
+    cairo_save(gc);
+
+    gdk_cairo_rectangle(gc, &pending_area);
+    cairo_clip(gc);
+
+    cairo_set_source(gc, pt->pen.style->bg_source);
+    cairo_paint(gc);
+
+    cairo_restore(gc);
+  }
+
+  if(pt->atlas_pending->len) {
+    cairo_set_source(gc, pt->pen.style->fg_source);
+
+    int x = glyphs_x;
+    for(int i = 0; i < pt->atlas_pending->len; i++) {
+      PangoTermGlyph *glyph = g_ptr_array_index(pt->atlas_pending, i);
+      if(glyph->mask)
+        cairo_mask_surface(gc, glyph->mask, x - pt->atlas.pad_x, glyphs_y - pt->atlas.pad_y);
+      x += glyph->width * pt->cell_width;
+    }
+
+    g_ptr_array_set_size(pt->atlas_pending, 0);
+  }
+
+  if(pt->n_ascii_pending) {
+    cairo_set_source(gc, pt->pen.style->fg_source);
+    cairo_set_scaled_font(gc, pt->ascii.font[ASCII_VARIANT(pt->pen.attrs)]);
+    cairo_show_glyphs(gc, pt->ascii_pending, pt->n_ascii_pending);
+
+    pt->n_ascii_pending = 0;
+  }
+
+  if(pt->glyphs->len && !pt->pen.attrs.underline && !pt->pen.attrs.strike) {
+    const PangoTermShapedRun *run = shaped_run_get(pt);
+
+    cairo_set_source(gc, pt->pen.style->fg_source);
+
+    for(int i = 0; i < run->n_items; i++) {
+      const PangoTermShapedItem *item = &run->items[i];
+      cairo_move_to(gc,
+          glyphs_x + (double)item->x / PANGO_SCALE,
+          glyphs_y + (double)item->baseline / PANGO_SCALE);
+      pango_cairo_show_glyph_string(gc, item->font, item->glyphs);
+    }
+
+    g_string_truncate(pt->glyphs, 0);
+  }
+  else if(pt->glyphs->len) {
+    PangoLayout *layout = pt->pen.layout;
+
+    pango_layout_set_text(layout, pt->glyphs->str, pt->glyphs->len);
+
+    if(pt->pen.pangoattrs)
+      pango_layout_set_attributes(layout, pt->pen.pangoattrs);
+
+    // Now adjust all the widths
+    fix_glyph_widths(pt, layout, (int *)pt->glyph_widths->data);
+
+    /* Draw glyphs */
+    cairo_set_source(gc, pt->pen.style->fg_source);
+    cairo_move_to(gc, glyphs_x, glyphs_y);
+    pango_cairo_show_layout(gc, layout);
+
+    g_string_truncate(pt->glyphs, 0);
+  }
+
+  if(pt->pen.attrs.dwl)
+    pt->pending_area.x *= 2, pt->pending_area.width *= 2;
+
+  mark_dirty(pt, &pt->pending_area);
+
+  pt->pending_area.width = 0;
+  pt->pending_area.height = 0;
+  pt->erase_columns = 0;
+
+  cairo_destroy(gc);
+
+  stats_phase(pt, prev_phase);
+}
+
+/* Make room for a whole row of pending glyphs up front, so put_glyph() never
+ * has to grow anything */
+static void glyph_buffers_reserve(PangoTerm *pt)
+{
+  if(pt->cols <= pt->glyphs_reserved_cols)
+    return;
+
+  /* g_unichar_to_utf8() writes at most 6 bytes */
+  gsize needed = pt->cols * VTERM_MAX_CHARS_PER_CELL * 6 + 1;
+
+  g_array_set_size(pt->glyph_widths, needed);
+
+  gsize len = pt->glyphs->len;
+  g_string_set_size(pt->glyphs, needed);
+  g_string_truncate(pt->glyphs, len);
+
+  guint n_pending = pt->atlas_pending->len;
+  g_ptr_array_set_size(pt->atlas_pending, pt->cols);
+  g_ptr_array_set_size(pt->atlas_pending, n_pending);
+
+  pt->ascii_pending = g_renew(cairo_glyph_t, pt->ascii_pending, pt->cols);
+
+  pt->glyphs_reserved_cols = pt->cols;
+}
+
+static void put_glyph(PangoTerm *pt, const uint32_t chars[], int width, VTermPos pos)
+{
+  PhyPos ph_pos = PHYSPOS_FROM_VTERMPOS(pt, pos);
+  if(ph_pos.prow < 0 || ph_pos.prow >= pt->rows)
+    return;
+
+  GdkRectangle destarea = GDKRECTANGLE_FROM_PHYPOS_CELLS(pt, ph_pos, width);
+
+  if(pt->erase_columns)
+    flush_pending(pt);
+  if(destarea.y != pt->pending_area.y || destarea.x != pt->pending_area.x + pt->pending_area.width)
+    flush_pending(pt);
+
+  PangoGlyph ascii = ascii_glyph(pt, &pt->pen.attrs, chars, width);
+
+  PangoTermGlyph *glyph = NULL;
+  if(!ascii && glyph_atlas_usable(pt, chars))
+    glyph = glyph_atlas_get(pt, chars[0], width);
+
+  /* A run is drawn wholly one way */
+  if(ascii ? pt->glyphs->len || pt->atlas_pending->len :
+     glyph ? pt->glyphs->len || pt->n_ascii_pending :
+             pt->atlas_pending->len || pt->n_ascii_pending)
+    flush_pending(pt);
+
+  if(ascii) {
+    int variant = ASCII_VARIANT(pt->pen.attrs);
+    int i = chars[0] - ASCII_FIRST;
+
+    /* Sized for a whole row by glyph_buffers_reserve() */
+    if(ascii != PANGO_GLYPH_EMPTY)
+      pt->ascii_pending[pt->n_ascii_pending++] = (cairo_glyph_t){
+        .index = ascii,
+        .x = destarea.x + pt->ascii.x[variant][i],
+        .y = destarea.y + pt->ascii.y[variant][i],
+      };
+  }
+  else if(glyph)
+    g_ptr_array_add(pt->atlas_pending, glyph);
+  else {
+    /* Both buffers were sized for a whole row by glyph_buffers_reserve() */
+    gsize start = pt->glyphs->len;
+    for(int i = 0; i < VTERM_MAX_CHARS_PER_CELL && chars[i]; i++)
+      g_string_append_unichar(pt->glyphs, chars[i]);
+
+    /* Every byte of the cell, combining marks included, so the run cache key
+     * never reads an unset width */
+    for(gsize i = start; i < pt->glyphs->len; i++)
+      g_array_index(pt->glyph_widths, int, i) = width;
+  }
+
+  if(pt->pending_area.width && pt->pending_area.height)
+    gdk_rectangle_union(&destarea, &pt->pending_area, &pt->pending_area);
+  else
+    pt->pending_area = destarea;
+}
+
+static void put_erase(PangoTerm *pt, int width, VTermPos pos)
+{
+  PhyPos ph_pos = PHYSPOS_FROM_VTERMPOS(pt, pos);
+  if(ph_pos.prow < 0 || ph_pos.prow >= pt->rows)
+    return;
+
+  GdkRectangle destarea = GDKRECTANGLE_FROM_PHYPOS_CELLS(pt, ph_pos, width);
+
+  if(!pt->erase_columns)
+    flush_pending(pt);
+  if(destarea.y != pt->pending_area.y || destarea.x != pt->pending_area.x + pt->pending_area.width)
+    flush_pending(pt);
+
+  if(pt->pending_area.width && pt->pending_area.height)
+    gdk_rectangle_union(&destarea, &pt->pending_area, &pt->pending_area);
+  else
+    pt->pending_area = destarea;
+
+  pt->erase_columns += width;
+}
+
+/*
+ * Shadow screen
+ */
+
+static void shadow_invalidate(PangoTerm *pt)
+{
+  if(pt->shadow.widths)
+    memset(pt->shadow.widths, SHADOW_INVALID, pt->shadow.rows * pt->shadow.cols);
+}
+
+static void shadow_invalidate_rows(PangoTerm *pt, int start_prow, int end_prow)
+{
+  if(pt->shadow.widths)
+    memset(pt->shadow.widths + start_prow * pt->shadow.cols, SHADOW_INVALID,
+        (end_prow - start_prow) * pt->shadow.cols);
+}
+
+static void shadow_free(PangoTerm *pt)
+{
+  g_free(pt->shadow.chars);
+  g_free(pt->shadow.styles);
+  g_free(pt->shadow.widths);
+  g_free(pt->shadow.new_chars);
+  g_free(pt->shadow.new_styles);
+  g_free(pt->shadow.new_widths);
+  g_free(pt->shadow.changed);
+}
+
+/* Reallocate for the current size; nothing painted before is trusted */
+static void shadow_resize(PangoTerm *pt)
+{
+  int n = pt->rows * pt->cols;
+
+  shadow_free(pt);
+
+  pt->shadow.rows = pt->rows;
+  pt->shadow.cols = pt->cols;
+
+  pt->shadow.chars  = g_new(guint32, n);
+  pt->shadow.styles = g_new(guint16, n);
+  pt->shadow.widths = g_new(guint8,  n);
+
+  /* Padded so the vector compare can always read a whole 16 cells */
+  int padded = (pt->cols + 15) & ~15;
+  pt->shadow.new_chars  = g_new0(guint32, padded);
+  pt->shadow.new_styles = g_new0(guint16, padded);
+  pt->shadow.new_widths = g_new0(guint8,  padded);
+  pt->shadow.changed    = g_new0(guint8,  padded);
+
+  shadow_invalidate(pt);
+}
+
+/* A single character as itself, or a hash of a combining sequence with the
+ * top bit set. The hash can collide, so shadow_diff() never takes two of them
+ * as equal */
+static guint32 shadow_chars(const uint32_t chars[])
+{
+  if(!chars[1])
+    return chars[0];
+
+  guint32 hash = chars[0];
+  for(int i = 1; i < VTERM_MAX_CHARS_PER_CELL && chars[i]; i++)
+    hash = hash * 31 + chars[i];
+
+  return hash | 0x80000000;
+}
+
+/* Record what was just painted at ph_pos */
+static void shadow_store(PangoTerm *pt, PhyPos ph_pos, const VTermScreenCell *cell, int style_id)
+{
+  if(!pt->shadow.widths || ph_pos.prow < 0 || ph_pos.prow >= pt->shadow.rows)
+    return;
+
+  guint32 chars = shadow_chars(cell->chars);
+  guint8 width  = cell->width;
+
+  int i = ph_pos.prow * pt->shadow.cols + ph_pos.pcol;
+  for(int col = ph_pos.pcol; col < ph_pos.pcol + cell->width && col < pt->shadow.cols; col++, i++) {
+    pt->shadow.chars[i]  = chars;
+    pt->shadow.styles[i] = style_id;
+    pt->shadow.widths[i] = width;
+  }
+}
+
+/* Follow a move of the pixels in dest from drow rows and dcol columns away */
+static void shadow_move(PangoTerm *pt, PhyRect dest, int drow, int dcol)
+{
+  if(!pt->shadow.widths)
+    return;
+
+  int cols = dest.end_pcol - dest.start_pcol;
+  int step = drow > 0 ? -1 : 1;
+  int first = drow > 0 ? dest.end_prow - 1 : dest.start_prow;
+
+  for(int prow = first; prow >= dest.start_prow && prow < dest.end_prow; prow += step) {
+    int src_prow = prow - drow;
+    int dst = prow * pt->shadow.cols + dest.start_pcol;
+
+    if(src_prow < 0 || src_prow >= pt->shadow.rows) {
+      memset(pt->shadow.widths + dst, SHADOW_INVALID, cols);
+      continue;
+    }
+
+    int src = src_prow * pt->shadow.cols + dest.start_pcol - dcol;
+    memmove(pt->shadow.chars  + dst, pt->shadow.chars  + src, cols * sizeof(guint32));
+    memmove(pt->shadow.styles + dst, pt->shadow.styles + src, cols * sizeof(guint16));
+    memmove(pt->shadow.widths + dst, pt->shadow.widths + src, cols * sizeof(guint8));
+  }
+}
+
+static guint64 style_key(const VTermScreenCell *cell, int cursoroverride)
+{
+  return (guint64)cell->attrs.bold            |
+         (guint64)cell->attrs.underline << 1  |
+         (guint64)cell->attrs.italic    << 3  |
+         (guint64)cell->attrs.reverse   << 4  |
+         (guint64)cell->attrs.strike    << 5  |
+         (guint64)cell->attrs.font      << 6  |
+         (guint64)cell->attrs.dwl       << 10 |
+         (guint64)cell->attrs.dhl       << 11 |
+         (guint64)!!cursoroverride      << 13 |
+         (guint64)cell->fg.rgb.red      << 14 |
+         (guint64)cell->fg.rgb.green    << 22 |
+         (guint64)cell->fg.rgb.blue     << 30 |
+         (guint64)cell->bg.rgb.red      << 38 |
+         (guint64)cell->bg.rgb.green    << 46 |
+         (guint64)cell->bg.rgb.blue     << 54;
+}
+
+static void style_free(gpointer data)
+{
+  PangoTermStyle *style = data;
+
+  pango_attr_list_unref(style->pangoattrs);
+  cairo_pattern_destroy(style->bg_source);
+  cairo_pattern_destroy(style->fg_source);
+  g_free(style);
+}
+
+static PangoAttrList *style_build_attrs(PangoTerm *pt, const VTermScreenCellAttrs *attrs)
+{
+  PangoAttrList *list = pango_attr_list_new();
+
+#define ADDATTR(a) \
+  do { \
+    PangoAttribute *newattr = (a); \
+    newattr->start_index = 0; \
+    newattr->end_index = -1; \
+    pango_attr_list_insert(list, newattr); \
+  } while(0)
+
+  if(attrs->bold)
+    ADDATTR(pango_attr_weight_new(PANGO_WEIGHT_BOLD));
+
+  switch(attrs->underline) {
+    case VTERM_UNDERLINE_OFF:
+      break;
+    case VTERM_UNDERLINE_DOUBLE:
+      ADDATTR(pango_attr_underline_new(PANGO_UNDERLINE_DOUBLE));
+      break;
+    case VTERM_UNDERLINE_CURLY:
+      /* PANGO_UNDERLINE_ERROR is usually rendered with a wavy shape */
+      ADDATTR(pango_attr_underline_new(PANGO_UNDERLINE_ERROR));
+      break;
+    default:
+      ADDATTR(pango_attr_underline_new(PANGO_UNDERLINE_SINGLE));
+  }
+
+  int font = attrs->font;
+  if(font >= pt->n_fonts)
+    font = 0;
+
+  if(attrs->italic && pt->font_italic != NULL)
+    ADDATTR(pango_attr_family_new(pt->font_italic));
+  else if(font)
+    ADDATTR(pango_attr_family_new(pt->fonts[font]));
+
+  if(attrs->italic && pt->font_italic == NULL)
+    ADDATTR(pango_attr_style_new(PANGO_STYLE_ITALIC));
+
+  if(attrs->strike)
+    ADDATTR(pango_attr_strikethrough_new(TRUE));
+
+#undef ADDATTR
+
+  return list;
+}
+
+static void ascii_glyphs_free(PangoTerm *pt)
+{
+  for(int variant = 0; variant < 4; variant++)
+    if(pt->ascii.font[variant]) {
+      cairo_scaled_font_destroy(pt->ascii.font[variant]);
+      pt->ascii.font[variant] = NULL;
+    }
+}
+
+/* Look up each printable ASCII character in the primary font. They're shaped
+ * one at a time, so no ligatures or kerning get baked in; any the font
+ * doesn't have are left to Pango to find a fallback for */
+static void ascii_glyphs_init(PangoTerm *pt, PangoContext *pctx, PangoFontDescription *fontdesc)
+{
+  /* Pending glyphs are from the old font */
+  flush_pending(pt);
+  ascii_glyphs_free(pt);
+
+  PangoLayout *layout = pango_layout_new(pctx);
+  pango_layout_set_font_description(layout, fontdesc);
+
+  for(int variant = 0; variant < 4; variant++) {
+    VTermScreenCellAttrs attrs = { .bold = variant & 1, .italic = variant >> 1 };
+    PangoAttrList *list = style_build_attrs(pt, &attrs);
+    pango_layout_set_attributes(layout, list);
+    pango_attr_list_unref(list);
+
+    /* Whichever font the space comes from stands for the primary font */
+    PangoFont *primary = NULL;
+
+    for(int i = 0; i < ASCII_COUNT; i++) {
+      char c = ASCII_FIRST + i;
+      pt->ascii.glyph[variant][i] = 0;
+
+      pango_layout_set_text(layout, &c, 1);
+
+      PangoLayoutIter *iter = pango_layout_get_iter(layout);
+      PangoLayoutRun *run = pango_layout_iter_get_run_readonly(iter);
+
+      if(run && run->glyphs->num_glyphs == 1) {
+        PangoFont *font = run->item->analysis.font;
+        if(!primary) {
+          primary = font;
+
+          cairo_scaled_font_t *scaled_font = pango_cairo_font_get_scaled_font(PANGO_CAIRO_FONT(font));
+          if(scaled_font)
+            pt->ascii.font[variant] = cairo_scaled_font_reference(scaled_font);
+        }
+
+        const PangoGlyphInfo *info = &run->glyphs->glyphs[0];
+        if(font == primary && !(info->glyph & PANGO_GLYPH_UNKNOWN_FLAG)) {
+          /* Centred in the cell, as fix_glyph_widths() does */
+          int x = info->geometry.x_offset;
+          if(info->geometry.width)
+            x -= (info->geometry.width - pt->cell_width_pango) / 2;
+
+          pt->ascii.glyph[variant][i] = info->glyph;
+          pt->ascii.x[variant][i] = (double)x / PANGO_SCALE;
+          pt->ascii.y[variant][i] = (double)(pango_layout_iter_get_baseline(iter) + info->geometry.y_offset) / PANGO_SCALE;
+        }
+      }
+
+      pango_layout_iter_free(iter);
+    }
+  }
+
+  g_object_unref(layout);
+}
+
+static const PangoTermStyle *style_intern(PangoTerm *pt, guint64 key, const VTermScreenCell *cell, int cursoroverride)
+{
+  PangoTermStyle *style = g_hash_table_lookup(pt->styles, &key);
+  if(style)
+    return style;
+
+  if(pt->styles_by_id->len >= STYLE_TABLE_MAX) {
+    /* The pen's own style is about to go */
+    flush_pending(pt);
+    pt->pen.key = STYLE_KEY_NONE;
+    pt->pen.style = NULL;
+    pt->pen.pangoattrs = NULL;
+
+    g_ptr_array_set_size(pt->styles_by_id, 0);
+    g_hash_table_remove_all(pt->styles);
+    pt->style_generation++;
+
+    /* Ids are about to be reused for different styles */
+    pt->shadow.last_key = STYLE_KEY_NONE;
+    shadow_invalidate(pt);
+  }
+
+  style = g_new0(PangoTermStyle, 1);
+  style->key = key;
+  style->id  = pt->styles_by_id->len;
+
+  style->attrs = (PangoTermPenAttrs){
+    .bold      = cell->attrs.bold,
+    .underline = cell->attrs.underline,
+    .italic    = cell->attrs.italic,
+    .reverse   = cell->attrs.reverse,
+    .strike    = cell->attrs.strike,
+    .font      = cell->attrs.font,
+    .dwl       = cell->attrs.dwl,
+    .dhl       = cell->attrs.dhl,
+  };
+
+  style->fg_col = GDK_COLOR_FROM_VTERM_COLOR(cell->fg);
+  style->bg_col = GDK_COLOR_FROM_VTERM_COLOR(cell->bg);
+
+  if(cursoroverride) {
+    int grey = ((int)pt->cursor_col.red + pt->cursor_col.green + pt->cursor_col.blue)*2 > 65535*3
+        ? 0 : 65535;
+    style->fg_col.red = style->fg_col.green = style->fg_col.blue = grey;
+    style->bg_col = pt->cursor_col;
+  }
+
+  style->pangoattrs = style_build_attrs(pt, &cell->attrs);
+
+  const GdkRGBA *bg = style->attrs.reverse ? &style->fg_col : &style->bg_col;
+  const GdkRGBA *fg = style->attrs.reverse ? &style->bg_col : &style->fg_col;
+  style->bg_source = cairo_pattern_create_rgba(bg->red, bg->green, bg->blue, bg->alpha);
+  style->fg_source = cairo_pattern_create_rgba(fg->red, fg->green, fg->blue, fg->alpha);
+  style->bg_pixel  = buffer_pixel(bg);
+
+  g_ptr_array_add(pt->styles_by_id, style);
+  g_hash_table_insert(pt->styles, &style->key, style);
+
+  return style;
+}
+
+static void chpen(VTermScreenCell *cell, void *user_data, int cursoroverride)
+{
+  PangoTerm *pt = user_data;
+
+  vterm_screen_convert_color_to_rgb(pt->vts, &cell->fg);
+  vterm_screen_convert_color_to_rgb(pt->vts, &cell->bg);
+
+  guint64 key = style_key(cell, cursoroverride);
+  if(key == pt->pen.key)
+    return;
+
+  const PangoTermStyle *style = style_intern(pt, key, cell, cursoroverride);
+
+  flush_pending(pt);
+
+  pt->pen.key        = key;
+  pt->pen.style      = style;
+  pt->pen.attrs      = style->attrs;
+  pt->pen.fg_col     = style->fg_col;
+  pt->pen.bg_col     = style->bg_col;
+  pt->pen.pangoattrs = style->pangoattrs;
+}
+
+/*
+ * Rasterizing large areas on worker threads
+ */
+
+/* Areas smaller than this are painted on the main thread */
+#define RASTER_MIN_ROWS   8
+#define RASTER_MIN_CELLS  4096
+
+typedef struct {
+  PangoLayout *layout;
+  guint font_serial;
+  GString *glyphs;
+  GArray *glyph_widths;
+  GArray *ascii_glyphs;
+} PangoTermRasterThread;
+
+static void raster_thread_free(gpointer data)
+{
+  PangoTermRasterThread *thread = data;
+
+  g_object_unref(thread->layout);
+  g_string_free(thread->glyphs, TRUE);
+  g_array_free(thread->glyph_widths, TRUE);
+  g_array_free(thread->ascii_glyphs, TRUE);
+  g_free(thread);
+}
+
+static GPrivate raster_thread_key = G_PRIVATE_INIT(raster_thread_free);
+
+static PangoTermRasterThread *raster_thread_get(PangoTerm *pt)
+{
+  PangoTermRasterThread *thread = g_private_get(&raster_thread_key);
+
+  if(!thread) {
+    thread = g_new0(PangoTermRasterThread, 1);
+
+    /* Pango's default font map is per-thread, so nothing here is shared with
+     * the main thread */
+    PangoContext *pctx = pango_font_map_create_context(pango_cairo_font_map_get_default());
+    pango_cairo_context_set_resolution(pctx, 100);
+    thread->layout = pango_layout_new(pctx);
+    g_object_unref(pctx);
+
+    thread->glyphs = g_string_new(NULL);
+    thread->glyph_widths = g_array_new(FALSE, FALSE, sizeof(int));
+    thread->ascii_glyphs = g_array_new(FALSE, FALSE, sizeof(cairo_glyph_t));
+
+    g_private_set(&raster_thread_key, thread);
+  }
+
+  if(thread->font_serial != pt->raster.font_serial) {
+    pango_layout_set_font_description(thread->layout, pt->raster.fontdesc);
+    thread->font_serial = pt->raster.font_serial;
+  }
+
+  return thread;
+}
+
+/* As flush_pending() would paint it, for runs of cells that share a style */
+static void raster_row(PangoTerm *pt, PangoTermRasterThread *thread, int prow, int start_pcol, int end_pcol)
+{
+  const PangoTermRasterCell *cells = pt->raster.cells + prow * pt->cols;
+  int y = prow * pt->cell_height;
+
+  /* g_unichar_to_utf8() writes at most 6 bytes */
+  g_array_set_size(thread->glyph_widths, pt->cols * VTERM_MAX_CHARS_PER_CELL * 6 + 1);
+  g_array_set_size(thread->ascii_glyphs, pt->cols);
+
+  cairo_t *gc = buffer_row_create(pt, prow);
+
+  for(int pcol = start_pcol; pcol < end_pcol; ) {
+    const PangoTermStyle *style = cells[pcol].style;
+    bool erase = !cells[pcol].chars[0];
+
+    g_string_truncate(thread->glyphs, 0);
+
+    int variant = ASCII_VARIANT(style->attrs);
+    cairo_glyph_t *ascii_glyphs = (cairo_glyph_t *)thread->ascii_glyphs->data;
+    int n_ascii = 0;
+    bool ascii = true;
+
+    int end = pcol;
+    while(end < end_pcol && cells[end].style == style && !cells[end].chars[0] == erase) {
+      if(!erase) {
+        g_array_index(thread->glyph_widths, int, thread->glyphs->len) = cells[end].width;
+
+        for(int i = 0; i < VTERM_MAX_CHARS_PER_CELL && cells[end].chars[i]; i++)
+          g_string_append_unichar(thread->glyphs, cells[end].chars[i]);
+
+        PangoGlyph glyph = ascii ? ascii_glyph(pt, &style->attrs, cells[end].chars, cells[end].width) : 0;
+        if(!glyph)
+          ascii = false;
+        else if(glyph != PANGO_GLYPH_EMPTY) {
+          int i = cells[end].chars[0] - ASCII_FIRST;
+          ascii_glyphs[n_ascii++] = (cairo_glyph_t){
+            .index = glyph,
+            .x = end * pt->cell_width + pt->ascii.x[variant][i],
+            .y = y + pt->ascii.y[variant][i],
+          };
+        }
+      }
+
+      end += cells[end].width;
+    }
+
+    buffer_fill_span(pt, &(GdkRectangle){
+        .x = pcol * pt->cell_width, .y = y,
+        .width = (end - pcol) * pt->cell_width, .height = pt->cell_height,
+      }, style->bg_pixel);
+
+    if(thread->glyphs->len && ascii) {
+      cairo_set_source(gc, style->fg_source);
+      cairo_set_scaled_font(gc, pt->ascii.font[variant]);
+      cairo_show_glyphs(gc, ascii_glyphs, n_ascii);
+    }
+    else if(thread->glyphs->len) {
+      PangoLayout *layout = thread->layout;
+
+      pango_layout_set_text(layout, thread->glyphs->str, thread->glyphs->len);
+      pango_layout_set_attributes(layout, style->pangoattrs);
+
+      fix_glyph_widths(pt, layout, (int *)thread->glyph_widths->data);
+
+      cairo_set_source(gc, style->fg_source);
+      cairo_move_to(gc, pcol * pt->cell_width, y);
+      pango_cairo_show_layout(gc, layout);
+    }
+
+    pcol = end;
+  }
+
+  cairo_destroy(gc);
+
+  /* Don't keep the style's attributes alive past a style table reset */
+  pango_layout_set_attributes(thread->layout, NULL);
+}
+
+static void raster_band(gpointer data, gpointer user_data)
+{
+  PangoTermRasterBand *band = data;
+  PangoTerm *pt = band->pt;
+  PangoTermRasterThread *thread = raster_thread_get(pt);
+
+  for(int prow = band->start_prow; prow < band->end_prow; prow++)
+    if(!pt->raster.serial_rows[prow])
+      raster_row(pt, thread, prow, band->start_pcol, band->end_pcol);
+
+  g_mutex_lock(&pt->raster.lock);
+  if(!--pt->raster.pending)
+    g_cond_signal(&pt->raster.done);
+  g_mutex_unlock(&pt->raster.lock);
+}
+
+static void raster_start(PangoTerm *pt)
+{
+  if(pt->raster.pool)
+    return;
+
+  g_mutex_init(&pt->raster.lock);
+  g_cond_init(&pt->raster.done);
+  pt->raster.bands = g_new0(PangoTermRasterBand, pt->raster.n_threads);
+  /* Exclusive, so each thread keeps its fonts and layout between frames */
+  pt->raster.pool = g_thread_pool_new(raster_band, NULL, pt->raster.n_threads, TRUE, NULL);
+}
+
+static void raster_free(PangoTerm *pt)
+{
+  if(pt->raster.pool) {
+    /* Waits for the workers, though none can be busy between frames */
+    g_thread_pool_free(pt->raster.pool, FALSE, TRUE);
+    g_mutex_clear(&pt->raster.lock);
+    g_cond_clear(&pt->raster.done);
+    g_free(pt->raster.bands);
+  }
+
+  g_free(pt->raster.cells);
+  g_free(pt->raster.serial_rows);
+  g_free(pt->raster.changed_rows);
+  g_free(pt->raster.changed_cells);
+
+  if(pt->raster.fontdesc)
+    pango_font_description_free(pt->raster.fontdesc);
+}
+
+static void raster_reserve(PangoTerm *pt)
+{
+  if(pt->rows * pt->cols > pt->raster.n_cells) {
+    pt->raster.n_cells = pt->rows * pt->cols;
+    pt->raster.cells = g_renew(PangoTermRasterCell, pt->raster.cells, pt->raster.n_cells);
+    pt->raster.changed_cells = g_renew(guint8, pt->raster.changed_cells, pt->raster.n_cells);
+  }
+
+  if(pt->rows > pt->raster.n_rows) {
+    pt->raster.n_rows = pt->rows;
+    pt->raster.serial_rows = g_renew(guint8, pt->raster.serial_rows, pt->raster.n_rows);
+    pt->raster.changed_rows = g_renew(guint8, pt->raster.changed_rows, pt->raster.n_rows);
+  }
+}
+
+static void repaint_phyrect(PangoTerm *pt, PhyRect ph_rect);
+
+/* Paint a large area as bands of rows on the worker threads. Everything that
+ * touches shared state (fetching cells, interning styles, the shadow) is done
+ * here first; the workers only read the prepared cells and styles and draw on
+ * their own rows of the buffer. Rows with double-width/height lines are left
+ * for the main thread afterwards. Returns false if the area
+ * wasn't worth it, having painted nothing */
+static bool repaint_phyrect_threaded(PangoTerm *pt, PhyRect ph_rect)
+{
+  if(ph_rect.start_prow < 0)
+    ph_rect.start_prow = 0;
+  if(ph_rect.end_prow > pt->rows)
+    ph_rect.end_prow = pt->rows;
+  if(ph_rect.end_pcol > pt->cols)
+    ph_rect.end_pcol = pt->cols;
+
+  int n_rows = ph_rect.end_prow - ph_rect.start_prow;
+
+  if(pt->raster.n_threads < 2 || n_rows < RASTER_MIN_ROWS ||
+      n_rows * (ph_rect.end_pcol - ph_rect.start_pcol) < RASTER_MIN_CELLS)
+    return false;
+
+  flush_pending(pt);
+  raster_reserve(pt);
+
+  guint style_generation = pt->style_generation;
+
+  PhyPos ph_pos;
+  for(ph_pos.prow = ph_rect.start_prow; ph_pos.prow < ph_rect.end_prow; ph_pos.prow++) {
+    PangoTermRasterCell *cells = pt->raster.cells + ph_pos.prow * pt->cols;
+    pt->raster.serial_rows[ph_pos.prow] = false;
+
+    for(ph_pos.pcol = ph_rect.start_pcol; ph_pos.pcol < ph_rect.end_pcol; ) {
+      VTermPos pos = VTERMPOS_FROM_PHYSPOS(pt, ph_pos);
+
+      VTermScreenCell cell;
+      fetch_cell(pt, pos, &cell);
+
+      if(cell.attrs.dwl || cell.attrs.dhl)
+        pt->raster.serial_rows[ph_pos.prow] = true;
+
+      chpen(&cell, pt, 0);
+      shadow_store(pt, ph_pos, &cell, pt->pen.style->id);
+
+      PangoTermRasterCell *rcell = &cells[ph_pos.pcol];
+      memcpy(rcell->chars, cell.chars, sizeof(rcell->chars));
+      rcell->style = pt->pen.style;
+      rcell->width = cell.width ? cell.width : 1;
+
+      ph_pos.pcol += rcell->width;
+    }
+  }
+
+  /* Styles already prepared were freed by a table reset */
+  if(pt->style_generation != style_generation)
+    return false;
+
+#ifdef DEBUG_ALLOC_COUNT
+  /* GThreadPool allocates a queue node per push, which is its business */
+  bool was_counting = alloc_counting;
+  alloc_counting = false;
+#endif
+
+  raster_start(pt);
+
+  int n_bands = MIN(pt->raster.n_threads, n_rows / (RASTER_MIN_ROWS / 2));
+  pt->raster.pending = n_bands;
 
-  char *chars_str = g_ucs4_to_utf8(chars, VTERM_MAX_CHARS_PER_CELL, NULL, NULL, NULL);
+  for(int i = 0; i < n_bands; i++) {
+    PangoTermRasterBand *band = &pt->raster.bands[i];
+    band->pt = pt;
+    band->start_prow = ph_rect.start_prow + n_rows * i / n_bands;
+    band->end_prow   = ph_rect.start_prow + n_rows * (i + 1) / n_bands;
+    band->start_pcol = ph_rect.start_pcol;
+    band->end_pcol   = ph_rect.end_pcol;
 
-  g_array_set_size(pt->glyph_widths, pt->glyphs->len + 1);
-  g_array_index(pt->glyph_widths, int, pt->glyphs->len) = width;
+    g_thread_pool_push(pt->raster.pool, band, NULL);
+  }
 
-  g_string_append(pt->glyphs, chars_str);
+  g_mutex_lock(&pt->raster.lock);
+  while(pt->raster.pending)
+    g_cond_wait(&pt->raster.done, &pt->raster.lock);
+  g_mutex_unlock(&pt->raster.lock);
 
-  g_free(chars_str);
+#ifdef DEBUG_ALLOC_COUNT
+  alloc_counting = was_counting;
+#endif
 
-  if(pt->pending_area.width && pt->pending_area.height)
-    gdk_rectangle_union(&destarea, &pt->pending_area, &pt->pending_area);
-  else
-    pt->pending_area = destarea;
+  GdkRectangle area = GDKRECTANGLE_FROM_PHYRECT(pt, ph_rect);
+  mark_dirty(pt, &area);
+
+  for(int prow = ph_rect.start_prow; prow < ph_rect.end_prow; prow++)
+    if(pt->raster.serial_rows[prow])
+      repaint_phyrect(pt, (PhyRect){
+          .start_prow = prow,
+          .end_prow   = prow + 1,
+          .start_pcol = ph_rect.start_pcol,
+          .end_pcol   = ph_rect.end_pcol,
+      });
+
+  return true;
 }
 
-static void put_erase(PangoTerm *pt, int width, VTermPos pos)
+static void repaint_phyrect(PangoTerm *pt, PhyRect ph_rect)
 {
-  PhyPos ph_pos = PHYSPOS_FROM_VTERMPOS(pt, pos);
-  if(ph_pos.prow < 0 || ph_pos.prow >= pt->rows)
+  if(repaint_phyrect_threaded(pt, ph_rect))
     return;
 
-  GdkRectangle destarea = GDKRECTANGLE_FROM_PHYPOS_CELLS(pt, ph_pos, width);
+  PhyPos ph_pos;
 
-  if(!pt->erase_columns)
-    flush_pending(pt);
-  if(destarea.y != pt->pending_area.y || destarea.x != pt->pending_area.x + pt->pending_area.width)
-    flush_pending(pt);
+  for(ph_pos.prow = ph_rect.start_prow; ph_pos.prow < ph_rect.end_prow; ph_pos.prow++) {
+    glyph_buffers_reserve(pt);
 
-  if(pt->pending_area.width && pt->pending_area.height)
-    gdk_rectangle_union(&destarea, &pt->pending_area, &pt->pending_area);
-  else
-    pt->pending_area = destarea;
+    for(ph_pos.pcol = ph_rect.start_pcol; ph_pos.pcol < ph_rect.end_pcol; ) {
+      VTermPos pos = VTERMPOS_FROM_PHYSPOS(pt, ph_pos);
 
-  pt->erase_columns += width;
-}
+      VTermScreenCell cell;
+      fetch_cell(pt, pos, &cell);
 
-static void chpen(VTermScreenCell *cell, void *user_data, int cursoroverride)
-{
-  PangoTerm *pt = user_data;
-  GdkRGBA col;
+      if(cell.attrs.dwl != pt->pending_dwl)
+        flush_pending(pt);
+      pt->pending_dwl = cell.attrs.dwl;
 
-#define ADDATTR(a) \
-  do { \
-    PangoAttribute *newattr = (a); \
-    newattr->start_index = 0; \
-    newattr->end_index = -1; \
-    pango_attr_list_change(pt->pen.pangoattrs, newattr); \
-  } while(0)
+      chpen(&cell, pt, 0);
+      shadow_store(pt, ph_pos, &cell, pt->pen.style->id);
 
-  if(cell->attrs.bold != pt->pen.attrs.bold) {
-    int bold = pt->pen.attrs.bold = cell->attrs.bold;
-    flush_pending(pt);
-    ADDATTR(pango_attr_weight_new(bold ? PANGO_WEIGHT_BOLD : PANGO_WEIGHT_NORMAL));
-  }
+      if(cell.chars[0] == 0) {
+        put_erase(pt, cell.width, pos);
+      }
+      else {
+        put_glyph(pt, cell.chars, cell.width, pos);
+      }
 
-  if(cell->attrs.underline != pt->pen.attrs.underline) {
-    int underline = pt->pen.attrs.underline = cell->attrs.underline;
-    flush_pending(pt);
-    switch(underline) {
-      case VTERM_UNDERLINE_OFF:
-        ADDATTR(pango_attr_underline_new(PANGO_UNDERLINE_NONE));
-        break;
-      case VTERM_UNDERLINE_DOUBLE:
-        ADDATTR(pango_attr_underline_new(PANGO_UNDERLINE_DOUBLE));
-        break;
-      case VTERM_UNDERLINE_CURLY:
-        /* PANGO_UNDERLINE_ERROR is usually rendered with a wavy shape */
-        ADDATTR(pango_attr_underline_new(PANGO_UNDERLINE_ERROR));
-        break;
-      default:
-        ADDATTR(pango_attr_underline_new(PANGO_UNDERLINE_SINGLE));
+      ph_pos.pcol += cell.width;
     }
   }
+}
 
-  if(cell->attrs.font != pt->pen.attrs.font) {
-    int font = pt->pen.attrs.font = cell->attrs.font;
-    if(font >= pt->n_fonts)
-      font = 0;
-    flush_pending(pt);
-    ADDATTR(pango_attr_family_new(pt->fonts[font]));
-  }
+/* Fill the shadow's new row with cells [start_pcol, end_pcol) of prow as they
+ * would be painted now */
+static void shadow_fetch_row(PangoTerm *pt, int prow, int start_pcol, int end_pcol)
+{
+  PhyPos ph_pos = { .prow = prow };
 
-  if(cell->attrs.italic != pt->pen.attrs.italic) {
-    int italic = pt->pen.attrs.italic = cell->attrs.italic;
-    flush_pending(pt);
-    if (pt->font_italic != NULL) {
-        char *font = italic ? pt->font_italic : pt->fonts[0];
-        ADDATTR(pango_attr_family_new(font));
-    } else {
-        ADDATTR(pango_attr_style_new(italic ? PANGO_STYLE_ITALIC : PANGO_STYLE_NORMAL));
+  for(ph_pos.pcol = start_pcol; ph_pos.pcol < end_pcol; ) {
+    VTermPos pos = VTERMPOS_FROM_PHYSPOS(pt, ph_pos);
+
+    VTermScreenCell cell;
+    fetch_cell(pt, pos, &cell);
+
+    vterm_screen_convert_color_to_rgb(pt->vts, &cell.fg);
+    vterm_screen_convert_color_to_rgb(pt->vts, &cell.bg);
+
+    guint64 key = style_key(&cell, 0);
+    if(key != pt->shadow.last_key) {
+      pt->shadow.last_id = style_intern(pt, key, &cell, 0)->id;
+      pt->shadow.last_key = key;
     }
-  }
 
-  if(cell->attrs.reverse != pt->pen.attrs.reverse) {
-    flush_pending(pt);
-    pt->pen.attrs.reverse = cell->attrs.reverse;
-  }
+    guint32 chars = shadow_chars(cell.chars);
+    guint8 width  = cell.width;
 
-  if(cell->attrs.strike != pt->pen.attrs.strike) {
-    int strike = pt->pen.attrs.strike = cell->attrs.strike;
-    flush_pending(pt);
-    ADDATTR(pango_attr_strikethrough_new(strike));
+    for(int i = 0; i < cell.width && ph_pos.pcol < end_pcol; i++, ph_pos.pcol++) {
+      int col = ph_pos.pcol - start_pcol;
+      pt->shadow.new_chars[col]  = chars;
+      pt->shadow.new_styles[col] = pt->shadow.last_id;
+      pt->shadow.new_widths[col] = width;
+    }
   }
+}
 
-  if(cell->attrs.dwl != pt->pen.attrs.dwl ||
-     cell->attrs.dhl != pt->pen.attrs.dhl) {
-    pt->pen.attrs.dwl = cell->attrs.dwl;
-    pt->pen.attrs.dhl = cell->attrs.dhl;
-    flush_pending(pt);
-  }
+#ifdef __SSE2__
+/* All ones in each of four cells whose chars match and are both single */
+static inline __m128i shadow_chars_eq4(const guint32 *old_chars, const guint32 *new_chars)
+{
+  __m128i old = _mm_loadu_si128((const __m128i *)old_chars);
+  __m128i new = _mm_loadu_si128((const __m128i *)new_chars);
+  __m128i hashed = _mm_srai_epi32(_mm_or_si128(old, new), 31);
 
-  vterm_screen_convert_color_to_rgb(pt->vts, &cell->fg);
-  col = GDK_COLOR_FROM_VTERM_COLOR(cell->fg);
+  return _mm_andnot_si128(hashed, _mm_cmpeq_epi32(old, new));
+}
+#endif
 
-  if(cursoroverride) {
-    int grey = ((int)pt->cursor_col.red + pt->cursor_col.green + pt->cursor_col.blue)*2 > 65535*3
-        ? 0 : 65535;
-    col.red = col.green = col.blue = grey;
+/* Compare n new cells against the shadow from offset i, setting changed[] for
+ * each that differs, or that holds a combining sequence either side. Returns
+ * how many did */
+static int shadow_diff(PangoTerm *pt, int i, int n, guint8 *changed)
+{
+  const guint32 *old_chars  = pt->shadow.chars  + i;
+  const guint16 *old_styles = pt->shadow.styles + i;
+  const guint8  *old_widths = pt->shadow.widths + i;
+  int n_changed = 0;
+  int col = 0;
+
+#ifdef __SSE2__
+  const __m128i ones = _mm_set1_epi8(-1);
+
+  for(; col + 16 <= n; col += 16) {
+    __m128i c0 = shadow_chars_eq4(old_chars + col,      pt->shadow.new_chars + col);
+    __m128i c1 = shadow_chars_eq4(old_chars + col + 4,  pt->shadow.new_chars + col + 4);
+    __m128i c2 = shadow_chars_eq4(old_chars + col + 8,  pt->shadow.new_chars + col + 8);
+    __m128i c3 = shadow_chars_eq4(old_chars + col + 12, pt->shadow.new_chars + col + 12);
+    __m128i s0 = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)(old_styles + col)),
+                                 _mm_loadu_si128((const __m128i *)(pt->shadow.new_styles + col)));
+    __m128i s1 = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)(old_styles + col + 8)),
+                                 _mm_loadu_si128((const __m128i *)(pt->shadow.new_styles + col + 8)));
+    __m128i w  = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(old_widths + col)),
+                                _mm_loadu_si128((const __m128i *)(pt->shadow.new_widths + col)));
+
+    /* Narrow everything down to one byte per cell, all ones where equal */
+    __m128i chars_eq  = _mm_packs_epi16(_mm_packs_epi32(c0, c1), _mm_packs_epi32(c2, c3));
+    __m128i styles_eq = _mm_packs_epi16(s0, s1);
+    __m128i eq = _mm_and_si128(_mm_and_si128(chars_eq, styles_eq), w);
+
+    int mask = _mm_movemask_epi8(eq);
+    if(mask == 0xffff) {
+      memset(changed + col, 0, 16);
+      continue;
+    }
+
+    _mm_storeu_si128((__m128i *)(changed + col), _mm_xor_si128(eq, ones));
+    n_changed += 16 - __builtin_popcount(mask);
   }
+#endif
 
-  if(col.red   != pt->pen.fg_col.red || col.green != pt->pen.fg_col.green || col.blue  != pt->pen.fg_col.blue) {
-    flush_pending(pt);
-    pt->pen.fg_col = col;
+  for(; col < n; col++) {
+    changed[col] = old_chars[col]  != pt->shadow.new_chars[col] ||
+                   (old_chars[col] & 0x80000000) ||
+                   old_styles[col] != pt->shadow.new_styles[col] ||
+                   old_widths[col] != pt->shadow.new_widths[col];
+    n_changed += changed[col] ? 1 : 0;
   }
 
-  vterm_screen_convert_color_to_rgb(pt->vts, &cell->bg);
-  col = GDK_COLOR_FROM_VTERM_COLOR(cell->bg);
+  return n_changed;
+}
 
-  if(cursoroverride)
-    col = pt->cursor_col;
+/* Repaint the runs of n cells of one row from start_pcol that changed[] marks */
+static void repaint_row_spans(PangoTerm *pt, int prow, int start_pcol, const guint8 *changed, int n)
+{
+  for(int col = 0; col < n; ) {
+    if(!changed[col]) {
+      col++;
+      continue;
+    }
 
-  if(col.red   != pt->pen.bg_col.red || col.green != pt->pen.bg_col.green || col.blue  != pt->pen.bg_col.blue) {
-    flush_pending(pt);
-    pt->pen.bg_col = col;
+    int end = col;
+    while(end < n && changed[end])
+      end++;
+
+    repaint_phyrect(pt, (PhyRect){
+        .start_prow = prow,
+        .end_prow   = prow + 1,
+        .start_pcol = start_pcol + col,
+        .end_pcol   = start_pcol + end,
+    });
+
+    col = end;
   }
 }
-static void pt_ibus_set_cursor_location(PangoTerm *pt, GdkRectangle cursor_area);
 
-static void repaint_phyrect(PangoTerm *pt, PhyRect ph_rect)
+/* Repaint only those cells of one row that differ from what's already there */
+static void repaint_row_changed(PangoTerm *pt, int prow, int start_pcol, int end_pcol)
 {
-  PhyPos ph_pos;
+  int n = end_pcol - start_pcol;
 
-  for(ph_pos.prow = ph_rect.start_prow; ph_pos.prow < ph_rect.end_prow; ph_pos.prow++) {
-    for(ph_pos.pcol = ph_rect.start_pcol; ph_pos.pcol < ph_rect.end_pcol; ) {
-      VTermPos pos = VTERMPOS_FROM_PHYSPOS(pt, ph_pos);
+  shadow_fetch_row(pt, prow, start_pcol, end_pcol);
 
-      VTermScreenCell cell;
-      fetch_cell(pt, pos, &cell);
+  if(shadow_diff(pt, prow * pt->cols + start_pcol, n, pt->shadow.changed))
+    repaint_row_spans(pt, prow, start_pcol, pt->shadow.changed, n);
+}
 
-      if(cell.attrs.dwl != pt->pending_dwl)
-        flush_pending(pt);
-      pt->pending_dwl = cell.attrs.dwl;
+/* Repaint only those cells in rect that differ from what's already there */
+static void repaint_rect_changed(PangoTerm *pt, VTermRect rect)
+{
+  PhyRect ph_rect = PHYRECT_FROM_VTERMRECT(pt, rect);
 
-      /* Invert the RV attribute if this cell is selected */
-      if(pt->highlight_valid) {
-        VTermPos start = pt->highlight_start,
-                 stop  = pt->highlight_stop;
+  if(!pt->shadow.widths || pt->shadow.cols != pt->cols || pt->shadow.rows != pt->rows) {
+    repaint_phyrect(pt, ph_rect);
+    return;
+  }
 
-        int highlighted = (pos.row > start.row || (pos.row == start.row && pos.col >= start.col)) &&
-                          (pos.row < stop.row  || (pos.row == stop.row  && pos.col <= stop.col));
+  if(ph_rect.start_prow < 0)
+    ph_rect.start_prow = 0;
+  if(ph_rect.end_prow > pt->rows)
+    ph_rect.end_prow = pt->rows;
+  if(ph_rect.end_pcol > pt->cols)
+    ph_rect.end_pcol = pt->cols;
 
-        if(highlighted)
-          cell.attrs.reverse = !cell.attrs.reverse;
-      }
+  int n = ph_rect.end_pcol - ph_rect.start_pcol;
 
-      int cursor_here = pos.row == pt->cursorpos.row && pos.col == pt->cursorpos.col;
-      int cursor_visible = CURSOR_ENABLED(pt) && (pt->cursor_blinkstate || !pt->has_focus);
-      int draw_cursor = cursor_visible && cursor_here;
+  if(pt->raster.n_threads < 2 || ph_rect.end_prow - ph_rect.start_prow < RASTER_MIN_ROWS) {
+    for(int prow = ph_rect.start_prow; prow < ph_rect.end_prow; prow++)
+      repaint_row_changed(pt, prow, ph_rect.start_pcol, ph_rect.end_pcol);
+    return;
+  }
 
-      chpen(&cell, pt, draw_cursor && pt->cursor_shape == VTERM_PROP_CURSORSHAPE_BLOCK);
+  /* Long runs of changed rows are painted whole, so they can go to the worker
+   * threads; the rest only where they changed */
+  raster_reserve(pt);
 
-      if(cell.chars[0] == 0) {
-        put_erase(pt, cell.width, pos);
-      }
-      else {
-        put_glyph(pt, cell.chars, cell.width, pos);
-      }
+  guint style_generation = pt->style_generation;
 
-      if(draw_cursor) {
-        GdkRectangle cursor_area = GDKRECTANGLE_FROM_PHYPOS_CELLS(pt, ph_pos, 1);
-        // gtk_im_context_set_cursor_location(pt->im_context, &cursor_area);
-        pt_ibus_set_cursor_location(pt, cursor_area);
-
-        if (pt->cursor_shape != VTERM_PROP_CURSORSHAPE_BLOCK) {
-            flush_pending(pt);
-
-            cairo_t *gc = cairo_create(pt->buffer);
-
-            gdk_cairo_rectangle(gc, &cursor_area);
-            cairo_clip(gc);
-
-            switch(pt->cursor_shape) {
-            case VTERM_PROP_CURSORSHAPE_UNDERLINE:
-              gdk_cairo_set_source_rgba(gc, &pt->cursor_col);
-              cairo_rectangle(gc,
-                  cursor_area.x,
-                  cursor_area.y + (int)(cursor_area.height * 0.85),
-                  cursor_area.width,
-                  (int)(cursor_area.height * 0.15));
-              cairo_fill(gc);
-              break;
-            case VTERM_PROP_CURSORSHAPE_BAR_LEFT:
-              gdk_cairo_set_source_rgba(gc, &pt->cursor_col);
-              cairo_rectangle(gc,
-                  cursor_area.x,
-                  cursor_area.y,
-                  (cursor_area.width * 0.15),
-                  cursor_area.height);
-              cairo_fill(gc);
-              break;
-            }
-
-            cairo_destroy(gc);
-          }
-      }
+  for(int prow = ph_rect.start_prow; prow < ph_rect.end_prow; prow++) {
+    shadow_fetch_row(pt, prow, ph_rect.start_pcol, ph_rect.end_pcol);
+    int i = prow * pt->cols + ph_rect.start_pcol;
+    pt->raster.changed_rows[prow] = shadow_diff(pt, i, n, pt->raster.changed_cells + i) > 0;
+  }
 
-      ph_pos.pcol += cell.width;
+  for(int prow = ph_rect.start_prow; prow < ph_rect.end_prow; ) {
+    int end = prow;
+    while(end < ph_rect.end_prow && pt->raster.changed_rows[end])
+      end++;
+
+    if(end - prow >= RASTER_MIN_ROWS) {
+      repaint_phyrect(pt, (PhyRect){
+          .start_prow = prow,
+          .end_prow   = end,
+          .start_pcol = ph_rect.start_pcol,
+          .end_pcol   = ph_rect.end_pcol,
+      });
+      prow = end;
+      continue;
     }
+
+    /* Painting other rows leaves these as the first pass found them, unless
+     * the style table was reset meanwhile */
+    for(; prow < end; prow++)
+      if(pt->style_generation == style_generation)
+        repaint_row_spans(pt, prow, ph_rect.start_pcol,
+            pt->raster.changed_cells + prow * pt->cols + ph_rect.start_pcol, n);
+      else
+        repaint_row_changed(pt, prow, ph_rect.start_pcol, ph_rect.end_pcol);
+    if(prow < ph_rect.end_prow)
+      prow++;
   }
 }
 
@@ -1010,50 +3312,146 @@ static void repaint_rect(PangoTerm *pt, VTermRect rect)
   repaint_phyrect(pt, ph_rect);
 }
 
-static void repaint_cell(PangoTerm *pt, VTermPos pos)
+/*
+ * Cursor
+ */
+
+/* Where the cursor is to be drawn over the buffer, if it's showing, and the
+ * cell under it */
+static bool cursor_area(PangoTerm *pt, GdkRectangle *area, VTermScreenCell *cell)
 {
-  VTermRect rect = {
-    .start_col = pos.col,
-    .end_col   = pos.col + 1,
-    .start_row = pos.row,
-    .end_row   = pos.row + 1,
-  };
+  /* Only blinks off while focused */
+  if(!pt->cursor_visible || !(pt->cursor_blinkstate || !pt->has_focus))
+    return false;
+
+  PhyPos ph_pos = PHYSPOS_FROM_VTERMPOS(pt, pt->cursorpos);
+  if(ph_pos.prow < 0 || ph_pos.prow >= pt->rows || ph_pos.pcol >= pt->cols)
+    return false;
+
+  fetch_cell(pt, pt->cursorpos, cell);
+
+  /* A block covers the whole of a wide character */
+  int width = 1;
+  if(pt->cursor_shape == VTERM_PROP_CURSORSHAPE_BLOCK && cell->width > 1)
+    width = cell->width;
 
-  repaint_rect(pt, rect);
+  GdkRectangle cursor_area = GDKRECTANGLE_FROM_PHYPOS_CELLS(pt, ph_pos, width);
+  if(cell->attrs.dwl)
+    cursor_area.x *= 2, cursor_area.width *= 2;
+
+  *area = cursor_area;
+  return true;
 }
 
-static void repaint_flow(PangoTerm *pt, VTermPos start, VTermPos stop)
+/* Draw the cell under a block cursor in the cursor's colours */
+static void draw_cursor_cell(PangoTerm *pt, cairo_t *gc, const GdkRectangle *area, const VTermScreenCell *cell)
 {
-  VTermRect rect;
+  VTermScreenCell cursor_cell = *cell;
+  vterm_screen_convert_color_to_rgb(pt->vts, &cursor_cell.fg);
+  vterm_screen_convert_color_to_rgb(pt->vts, &cursor_cell.bg);
 
-  if(start.row == stop.row) {
-    rect.start_col = start.col;
-    rect.start_row = start.row;
-    rect.end_col   = stop.col + 1;
-    rect.end_row   = start.row + 1;
-    repaint_rect(pt, rect);
+  const PangoTermStyle *style = style_intern(pt, style_key(&cursor_cell, 1), &cursor_cell, 1);
+
+  cairo_set_source(gc, style->bg_source);
+  cairo_paint(gc);
+
+  if(!cursor_cell.chars[0])
+    return;
+
+  char str[VTERM_MAX_CHARS_PER_CELL * 6];
+  int widths[VTERM_MAX_CHARS_PER_CELL * 6];
+  int len = 0;
+  for(int i = 0; i < VTERM_MAX_CHARS_PER_CELL && cursor_cell.chars[i]; i++)
+    len += g_unichar_to_utf8(cursor_cell.chars[i], str + len);
+  for(int i = 0; i < len; i++)
+    widths[i] = cursor_cell.width;
+
+  /* Nothing is pending on the pen's layout outside of flush_pending() */
+  PangoLayout *layout = pt->pen.layout;
+  pango_layout_set_text(layout, str, len);
+  pango_layout_set_attributes(layout, style->pangoattrs);
+  fix_glyph_widths(pt, layout, widths);
+
+  cairo_translate(gc, area->x, area->y);
+  if(cursor_cell.attrs.dwl)
+    cairo_scale(gc, 2.0, 1.0);
+  if(cursor_cell.attrs.dhl) {
+    cairo_scale(gc, 1.0, 2.0);
+    if(cursor_cell.attrs.dhl == 2)
+      cairo_translate(gc, 0, -pt->cell_height / 2.0);
   }
-  else {
-    rect.start_col = start.col;
-    rect.start_row = start.row;
-    rect.end_col   = pt->cols;
-    rect.end_row   = start.row + 1;
-    repaint_rect(pt, rect);
 
-    if(start.row + 1 < stop.row) {
-      rect.start_col = 0;
-      rect.start_row = start.row + 1;
-      rect.end_col   = pt->cols;
-      rect.end_row   = stop.row;
-      repaint_rect(pt, rect);
-    }
+  cairo_set_source(gc, style->fg_source);
+  cairo_move_to(gc, 0, 0);
+  pango_cairo_show_layout(gc, layout);
+}
 
-    rect.start_col = 0;
-    rect.start_row = stop.row;
-    rect.end_col   = stop.col + 1;
-    rect.end_row   = stop.row + 1;
-    repaint_rect(pt, rect);
+/* Draw the cursor over what's already been blitted, with gc in buffer
+ * coordinates */
+static void draw_cursor(PangoTerm *pt, cairo_t *gc, const GdkRectangle *area, const VTermScreenCell *cell)
+{
+  cairo_save(gc);
+
+  gdk_cairo_rectangle(gc, area);
+  cairo_clip(gc);
+
+  gdk_cairo_set_source_rgba(gc, &pt->cursor_col);
+
+  switch(pt->cursor_shape) {
+  case VTERM_PROP_CURSORSHAPE_BLOCK:
+    if(pt->has_focus)
+      draw_cursor_cell(pt, gc, area, cell);
+    else {
+      /* Hollow, to show the window isn't the one being typed into */
+      cairo_set_line_width(gc, 1.0);
+      cairo_rectangle(gc, area->x + 0.5, area->y + 0.5, area->width - 1, area->height - 1);
+      cairo_stroke(gc);
+    }
+    break;
+  case VTERM_PROP_CURSORSHAPE_UNDERLINE:
+    cairo_rectangle(gc,
+        area->x,
+        area->y + (int)(area->height * 0.85),
+        area->width,
+        (int)(area->height * 0.15));
+    cairo_fill(gc);
+    break;
+  case VTERM_PROP_CURSORSHAPE_BAR_LEFT:
+    cairo_rectangle(gc,
+        area->x,
+        area->y,
+        (area->width * 0.15),
+        area->height);
+    cairo_fill(gc);
+    break;
   }
+
+  cairo_restore(gc);
+}
+
+/* The cursor has moved or changed how it looks. Nothing in the buffer needs
+ * repainting; it's only drawn again over the top */
+static void cursor_changed(PangoTerm *pt)
+{
+  if(pt->headless_target)
+    /* blit_dirty() covers up the old one */
+    pt->dirty = true;
+  else
+    queue_draw(pt);
+}
+
+/*
+ * Selection
+ */
+
+/* The selection has changed; like the cursor, it's only drawn over the top */
+static void selection_changed(PangoTerm *pt)
+{
+  if(pt->headless_target)
+    /* blit_dirty() covers up the old one */
+    pt->dirty = true;
+  else
+    queue_draw(pt);
 }
 
 static gboolean cursor_blink(void *user_data)
@@ -1062,10 +3460,8 @@ static gboolean cursor_blink(void *user_data)
 
   pt->cursor_blinkstate = !pt->cursor_blinkstate;
 
-  if(CURSOR_ENABLED(pt)) {
-    repaint_cell(pt, pt->cursorpos);
-
-    flush_pending(pt);
+  if(pt->cursor_visible) {
+    cursor_changed(pt);
     blit_dirty(pt);
   }
 
@@ -1082,8 +3478,8 @@ static void cursor_start_blinking(PangoTerm *pt)
   /* Should start blinking in visible state */
   pt->cursor_blinkstate = 1;
 
-  if(CURSOR_ENABLED(pt))
-    repaint_cell(pt, pt->cursorpos);
+  if(pt->cursor_visible)
+    cursor_changed(pt);
 }
 
 static void cursor_stop_blinking(PangoTerm *pt)
@@ -1094,8 +3490,8 @@ static void cursor_stop_blinking(PangoTerm *pt)
   /* Should always be in visible state */
   pt->cursor_blinkstate = 1;
 
-  if(CURSOR_ENABLED(pt))
-    repaint_cell(pt, pt->cursorpos);
+  if(pt->cursor_visible)
+    cursor_changed(pt);
 }
 
 static void store_clipboard(PangoTerm *pt)
@@ -1126,8 +3522,7 @@ static void cancel_highlight(PangoTerm *pt)
 
   pt->highlight_valid = FALSE;
 
-  repaint_flow(pt, pt->highlight_start, pt->highlight_stop);
-  flush_pending(pt);
+  selection_changed(pt);
   blit_dirty(pt);
 }
 
@@ -1135,6 +3530,129 @@ static void cancel_highlight(PangoTerm *pt)
  * VTerm event handlers
  */
 
+static void schedule_frame(PangoTerm *pt);
+
+/*
+ * Damage is only collected as it arrives, and repainted once per frame, so
+ * anything overwritten within a frame is never rasterized
+ */
+
+/* Reallocate for the current size, with everything damaged */
+static void damage_resize(PangoTerm *pt)
+{
+  pt->n_damage_rows = pt->rows;
+  pt->damage_rows = g_realloc_n(pt->damage_rows, pt->rows, sizeof(pt->damage_rows[0]));
+
+  for(int row = 0; row < pt->n_damage_rows; row++) {
+    pt->damage_rows[row].c0 = 0;
+    pt->damage_rows[row].c1 = pt->cols;
+  }
+
+  pt->damaged = true;
+}
+
+static void damage_add(PangoTerm *pt, VTermRect rect)
+{
+  int start_row = MAX(rect.start_row, 0);
+  int end_row   = MIN(rect.end_row, pt->n_damage_rows);
+
+  for(int row = start_row; row < end_row; row++) {
+    if(pt->damage_rows[row].c0 >= pt->damage_rows[row].c1) {
+      pt->damage_rows[row].c0 = rect.start_col;
+      pt->damage_rows[row].c1 = rect.end_col;
+      continue;
+    }
+
+    if(rect.start_col < pt->damage_rows[row].c0)
+      pt->damage_rows[row].c0 = rect.start_col;
+    if(rect.end_col > pt->damage_rows[row].c1)
+      pt->damage_rows[row].c1 = rect.end_col;
+  }
+
+  pt->damaged = true;
+}
+
+/* Repaint everything damaged, as rectangles of consecutive rows with the same
+ * span so that large areas can go to the worker threads */
+static void damage_flush(PangoTerm *pt)
+{
+  if(!pt->damaged)
+    return;
+
+  pt->damaged = false;
+
+  int prev_phase = stats_phase(pt, PHASE_DAMAGE);
+
+  for(int row = 0; row < pt->n_damage_rows; ) {
+    int c0 = pt->damage_rows[row].c0, c1 = pt->damage_rows[row].c1;
+    if(c0 >= c1) {
+      row++;
+      continue;
+    }
+
+    int end_row = row + 1;
+    while(end_row < pt->n_damage_rows &&
+        pt->damage_rows[end_row].c0 == c0 && pt->damage_rows[end_row].c1 == c1)
+      end_row++;
+
+    for(int i = row; i < end_row; i++)
+      pt->damage_rows[i].c0 = pt->damage_rows[i].c1 = 0;
+
+    repaint_rect_changed(pt, (VTermRect){
+        .start_row = row,
+        .end_row   = end_row,
+        .start_col = c0,
+        .end_col   = c1,
+    });
+
+    row = end_row;
+  }
+
+  stats_phase(pt, prev_phase);
+}
+
+/* vterm has moved the cells of src to dest. Damage on whole rows moves with
+ * them; rows scrolled away take theirs with them and are never painted. A
+ * move of part of a row can't carry a span, so the part of it that moved is
+ * added at dest as well, and the frame repaints from the cells where they
+ * are now */
+static void damage_move(PangoTerm *pt, VTermRect dest, VTermRect src)
+{
+  if(!pt->damaged)
+    return;
+
+  if(src.start_col == 0 && src.end_col == pt->cols && dest.start_col == 0 && dest.end_col == pt->cols) {
+    memmove(pt->damage_rows + dest.start_row, pt->damage_rows + src.start_row,
+        (dest.end_row - dest.start_row) * sizeof(pt->damage_rows[0]));
+    return;
+  }
+
+  int delta_row = dest.start_row - src.start_row;
+  int delta_col = dest.start_col - src.start_col;
+
+  /* Walk away from the direction of the move so no source row is read after
+   * it has gained damage from another */
+  int step  = delta_row > 0 ? -1 : 1;
+  int first = delta_row > 0 ? src.end_row - 1 : src.start_row;
+
+  for(int row = first; row >= src.start_row && row < src.end_row; row += step) {
+    if(row < 0 || row >= pt->n_damage_rows)
+      continue;
+
+    int c0 = MAX(pt->damage_rows[row].c0, src.start_col);
+    int c1 = MIN(pt->damage_rows[row].c1, src.end_col);
+    if(c0 >= c1)
+      continue;
+
+    damage_add(pt, (VTermRect){
+        .start_row = row + delta_row,
+        .end_row   = row + delta_row + 1,
+        .start_col = c0 + delta_col,
+        .end_col   = c1 + delta_col,
+    });
+  }
+}
+
 static int term_damage(VTermRect rect, void *user_data)
 {
   PangoTerm *pt = user_data;
@@ -1149,7 +3667,8 @@ static int term_damage(VTermRect rect, void *user_data)
     }
   }
 
-  repaint_rect(pt, rect);
+  damage_add(pt, rect);
+  schedule_frame(pt);
 
   return 1;
 }
@@ -1158,31 +3677,30 @@ static int term_sb_pushline(int cols, const VTermScreenCell *cells, void *user_d
 {
   PangoTerm *pt = user_data;
 
-  PangoTermScrollbackLine *linebuffer = NULL;
-  if(pt->scroll_current == pt->scroll_size) {
-    /* Recycle old row if it's the right size */
-    if(pt->sb_buffer[pt->scroll_current-1]->cols == cols)
-      linebuffer = pt->sb_buffer[pt->scroll_current-1];
-    else
-      free(pt->sb_buffer[pt->scroll_current-1]);
+  if(!pt->sb_capacity)
+    return 0;
 
-    memmove(pt->sb_buffer + 1, pt->sb_buffer, sizeof(pt->sb_buffer[0]) * (pt->scroll_current - 1));
-  }
-  else if(pt->scroll_current > 0) {
-    memmove(pt->sb_buffer + 1, pt->sb_buffer, sizeof(pt->sb_buffer[0]) * pt->scroll_current);
-  }
+  /* The slot just before the head is either unused, or holds the oldest line
+   * when the ring is full */
+  int slot = (pt->sb_head + pt->sb_capacity - 1) % pt->sb_capacity;
 
-  if(!linebuffer) {
-    linebuffer = g_malloc0(sizeof(PangoTermScrollbackLine) + cols * sizeof(linebuffer->cells[0]));
-    linebuffer->cols = cols;
+  if(pt->sb_hot == pt->sb_capacity) {
+    if(pt->sb_spill_fd != -1)
+      sb_spill_push(pt, pt->sb_buffer[slot]);
+    else if(pt->sb_cold_pending)
+      sb_cold_push(pt, pt->sb_buffer[slot]);
+    else {
+      sb_line_free(pt, pt->sb_buffer[slot]);
+      pt->scroll_current--;
+    }
   }
+  else
+    pt->sb_hot++;
 
-  pt->sb_buffer[0] = linebuffer;
-
-  if(pt->scroll_current < pt->scroll_size)
-    pt->scroll_current++;
+  pt->sb_buffer[slot] = sb_line_encode(cols, cells);
+  pt->sb_head = slot;
 
-  memcpy(linebuffer->cells, cells, sizeof(cells[0]) * cols);
+  pt->scroll_current++;
 
   return 1;
 }
@@ -1191,18 +3709,21 @@ static int term_sb_popline(int cols, VTermScreenCell *cells, void *user_data)
 {
   PangoTerm *pt = user_data;
 
-  if(!pt->scroll_current)
+  /* Lines already moved to the cold tier stay there */
+  if(!pt->sb_hot)
     return 0;
 
-  PangoTermScrollbackLine *linebuffer = pt->sb_buffer[0];
+  PangoTermScrollbackLine *linebuffer = pt->sb_buffer[pt->sb_head];
+  pt->sb_buffer[pt->sb_head] = NULL;
+  pt->sb_head = (pt->sb_head + 1) % pt->sb_capacity;
+  pt->sb_hot--;
   pt->scroll_current--;
-  memmove(pt->sb_buffer, pt->sb_buffer + 1, sizeof(pt->sb_buffer[0]) * (pt->scroll_current));
 
   int cols_to_copy = cols;
   if(cols_to_copy > linebuffer->cols)
     cols_to_copy = linebuffer->cols;
 
-  memcpy(cells, linebuffer->cells, sizeof(cells[0]) * cols_to_copy);
+  sb_line_decode(linebuffer, cells, cols_to_copy);
 
   for(int col = cols_to_copy; col < cols; col++) {
     cells[col] = (VTermScreenCell){
@@ -1214,7 +3735,7 @@ static int term_sb_popline(int cols, VTermScreenCell *cells, void *user_data)
     };
   }
 
-  free(linebuffer);
+  sb_line_free(pt, linebuffer);
 
   return 1;
 }
@@ -1223,8 +3744,8 @@ static int term_moverect(VTermRect dest, VTermRect src, void *user_data)
 {
   PangoTerm *pt = user_data;
 
+  damage_move(pt, dest, src);
   flush_pending(pt);
-  blit_dirty(pt);
 
   if(pt->highlight_valid) {
     int start_inside = vterm_rect_contains(src, pt->highlight_start);
@@ -1257,26 +3778,35 @@ static int term_moverect(VTermRect dest, VTermRect src, void *user_data)
 
   GdkRectangle destarea = GDKRECTANGLE_FROM_PHYRECT(pt, ph_dest);
 
-  cairo_surface_flush(pt->buffer);
-  cairo_t* gc = cairo_create(pt->buffer);
-  gdk_cairo_rectangle(gc, &destarea);
-  cairo_clip(gc);
-  cairo_set_source_surface(gc,
-      pt->buffer,
-      (dest.start_col - src.start_col) * pt->cell_width,
-      (dest.start_row - src.start_row) * pt->cell_height);
-  // HACK: for some reason cairo_paint() from a surface to itself
-  // does not work when scrolling up (memset rather than memmove)
-  // somehow this depends on some configuration of the surface itself
-  // (works like memmove on x11, but like memcpy on wayland)
-  cairo_push_group(gc);
-  cairo_paint(gc);
-  cairo_pop_group_to_source(gc);
-  cairo_paint(gc);
+  int prev_phase = stats_phase(pt, PHASE_DAMAGE);
 
-  cairo_destroy(gc);
+  int delta_row = dest.start_row - src.start_row;
+  int delta_col = dest.start_col - src.start_col;
 
-  gtk_widget_queue_draw(pt->termda);
+  bool whole_rows = src.start_col == 0 && dest.start_col == 0 && dest.end_col == pt->cols &&
+      ph_dest.start_prow - delta_row >= 0 && ph_dest.end_prow - delta_row <= pt->rows;
+
+  if(whole_rows)
+    buffer_rows_move(pt, ph_dest.start_prow, ph_dest.end_prow, delta_row);
+  else
+    buffer_copy_rect(pt, ph_dest, delta_row, delta_col);
+
+  shadow_move(pt, ph_dest, delta_row, delta_col);
+
+  if(whole_rows) {
+    /* vterm erases the rows left behind, which now hold old strips */
+    if(delta_row > 0)
+      shadow_invalidate_rows(pt, ph_dest.start_prow - delta_row, ph_dest.start_prow);
+    else
+      shadow_invalidate_rows(pt, ph_dest.end_prow, ph_dest.end_prow - delta_row);
+  }
+
+  if(pt->termda && whole_rows)
+    row_nodes_move(pt, ph_dest.start_prow, ph_dest.end_prow, delta_row);
+  else
+    mark_dirty(pt, &destarea);
+
+  stats_phase(pt, prev_phase);
 
   return 1;
 }
@@ -1288,6 +3818,8 @@ static int term_movecursor(VTermPos pos, VTermPos oldpos, int visible, void *use
   pt->cursorpos = pos;
   pt->cursor_blinkstate = 1;
 
+  cursor_changed(pt);
+
   return 1;
 }
 
@@ -1310,6 +3842,7 @@ static int term_settermprop(VTermProp prop, VTermValue *val, void *user_data)
   switch(prop) {
   case VTERM_PROP_CURSORVISIBLE:
     pt->cursor_visible = val->boolean;
+    cursor_changed(pt);
     break;
 
   case VTERM_PROP_CURSORBLINK:
@@ -1321,14 +3854,17 @@ static int term_settermprop(VTermProp prop, VTermValue *val, void *user_data)
 
   case VTERM_PROP_CURSORSHAPE:
     pt->cursor_shape = val->number;
+    cursor_changed(pt);
     break;
 
   case VTERM_PROP_ICONNAME:
-    gtk_window_set_icon_name(GTK_WINDOW(pt->termwin), pt->tmpbuffer->str);
+    if(pt->termwin)
+      gtk_window_set_icon_name(GTK_WINDOW(pt->termwin), pt->tmpbuffer->str);
     break;
 
   case VTERM_PROP_TITLE:
-    gtk_window_set_title(GTK_WINDOW(pt->termwin), pt->tmpbuffer->str);
+    if(pt->termwin)
+      gtk_window_set_title(GTK_WINDOW(pt->termwin), pt->tmpbuffer->str);
     break;
 
   case VTERM_PROP_ALTSCREEN:
@@ -1350,7 +3886,8 @@ static int term_bell(void *user_data)
 {
   PangoTerm *pt = user_data;
 
-  gtk_widget_error_bell(GTK_WIDGET(pt->termwin));
+  if(pt->termwin)
+    gtk_widget_error_bell(GTK_WIDGET(pt->termwin));
   return 1;
 }
 
@@ -1407,10 +3944,10 @@ static void vscroll_delta(PangoTerm *pt, int delta)
   if(!delta)
     return;
 
-  pt->scroll_offs += delta;
+  /* Damage is in screen rows, which are about to move on the window */
+  damage_flush(pt);
 
-  pt->cursor_hidden_for_redraw = 1;
-  repaint_cell(pt, pt->cursorpos);
+  pt->scroll_offs += delta;
 
   PhyRect ph_repaint = {
       .start_pcol = 0,
@@ -1438,31 +3975,20 @@ static void vscroll_delta(PangoTerm *pt, int delta)
 
     GdkRectangle destarea = GDKRECTANGLE_FROM_PHYRECT(pt, ph_dest);
 
-    cairo_surface_flush(pt->buffer);
-    cairo_t *gc = cairo_create(pt->buffer);
-    gdk_cairo_rectangle(gc, &destarea);
-    cairo_clip(gc);
-    cairo_set_source_surface(gc, pt->buffer, 0, delta * pt->cell_height);
-    // HACK: for some reason cairo_paint() from a surface to itself
-    // does not work when scrolling up (memset rather than memmove)
-    // somehow this depends on some configuration of the surface itself
-    // (works like memmove on x11, but like memcpy on wayland)
-    cairo_push_group(gc);
-    cairo_paint(gc);
-    cairo_pop_group_to_source(gc);
-    cairo_paint(gc);
-
-    cairo_destroy(gc);
+    /* The rows left behind are repainted below */
+    buffer_rows_move(pt, ph_dest.start_prow, ph_dest.end_prow, delta);
+    shadow_move(pt, ph_dest, delta, 0);
+
+    if(pt->termda)
+      row_nodes_move(pt, ph_dest.start_prow, ph_dest.end_prow, delta);
+    else
+      mark_dirty(pt, &destarea);
   }
 
   repaint_phyrect(pt, ph_repaint);
 
-  pt->cursor_hidden_for_redraw = 0;
-  repaint_cell(pt, pt->cursorpos);
-
   flush_pending(pt);
-
-  gtk_widget_queue_draw(pt->termda);
+  blit_dirty(pt);
 }
 
 static gboolean pangoterm_keypress(PangoTerm *pt, guint keyval, guint keycode, GdkModifierType state);
@@ -1931,8 +4457,7 @@ static gboolean widget_mousepress(GtkGesture *gesture, gint n_press, gdouble x,
     pt->highlight_start = start_pos;
     pt->highlight_stop  = stop_pos;
 
-    repaint_flow(pt, pt->highlight_start, pt->highlight_stop);
-    flush_pending(pt);
+    selection_changed(pt);
     blit_dirty(pt);
     store_clipboard(pt);
   }
@@ -1944,8 +4469,7 @@ static gboolean widget_mousepress(GtkGesture *gesture, gint n_press, gdouble x,
     pt->highlight_stop.row  = pos.row;
     pt->highlight_stop.col  = pt->cols - 1;
 
-    repaint_flow(pt, pt->highlight_start, pt->highlight_stop);
-    flush_pending(pt);
+    selection_changed(pt);
     blit_dirty(pt);
     store_clipboard(pt);
   }
@@ -2000,9 +4524,6 @@ static gboolean widget_mousemove(GtkEventController *controller, gdouble x, gdou
 
     pt->highlight_valid = true;
 
-    VTermPos repaint_start = pt->highlight_start;
-    VTermPos repaint_stop  = pt->highlight_stop;
-
     if(vterm_pos_cmp(pt->drag_start, pt->drag_pos) > 0) {
       pt->highlight_start = pt->drag_pos;
       pt->highlight_stop  = pt->drag_start;
@@ -2018,14 +4539,7 @@ static gboolean widget_mousemove(GtkEventController *controller, gdouble x, gdou
         pt->highlight_stop.col = pt->cols - 1;
     }
 
-    if(vterm_pos_cmp(pt->highlight_start, repaint_start) < 0)
-      repaint_start = pt->highlight_start;
-    if(vterm_pos_cmp(pt->highlight_stop, repaint_stop) > 0)
-      repaint_stop  = pt->highlight_stop;
-
-    repaint_flow(pt, repaint_start, repaint_stop);
-
-    flush_pending(pt);
+    selection_changed(pt);
     blit_dirty(pt);
   }
 
@@ -2123,10 +4637,36 @@ vendored_gdk_cairo_get_clip_rectangle (cairo_t      *cr,
   return clip_exists;
 }
 
-static void widget_draw(GtkDrawingArea *da, cairo_t *gc, int width, int height, gpointer user_data)
+/* Buffer pixels are cairo's RGB24, which is native-endian xRGB */
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+# define BUFFER_MEMORY_FORMAT GDK_MEMORY_B8G8R8X8
+#else
+# define BUFFER_MEMORY_FORMAT GDK_MEMORY_X8R8G8B8
+#endif
+
+static GskRenderNode *row_node_new(PangoTerm *pt, int row)
 {
-  PangoTerm *pt = user_data;
+  cairo_surface_flush(pt->buffer[row]);
+
+  int stride = cairo_image_surface_get_stride(pt->buffer[row]);
+  const unsigned char *data = cairo_image_surface_get_data(pt->buffer[row]);
+  int height = cairo_image_surface_get_height(pt->buffer[row]);
 
+  /* The texture is in device pixels; the node is sized in logical ones */
+  GBytes *bytes = g_bytes_new(data, height * stride);
+  GdkTexture *texture = gdk_memory_texture_new(cairo_image_surface_get_width(pt->buffer[row]), height,
+      BUFFER_MEMORY_FORMAT, bytes, stride);
+  g_bytes_unref(bytes);
+
+  GskRenderNode *node = gsk_texture_node_new(texture,
+      &GRAPHENE_RECT_INIT(0, 0, pt->cols * pt->cell_width, pt->cell_height));
+  g_object_unref(texture);
+
+  return node;
+}
+
+static void widget_snapshot(PangoTerm *pt, GtkSnapshot *snapshot, int width, int height)
+{
   /* GDK always sends resize events before expose events, so it's possible this
    * expose event is for a region that now doesn't exist.
    */
@@ -2139,25 +4679,159 @@ static void widget_draw(GtkDrawingArea *da, cairo_t *gc, int width, int height,
   if(height > bottom)
     height = bottom;
 
-  if(height && width) {
-    {
-      // TODO: "bleed" out the edge of the backing buffer instead
-      cairo_save(gc);
-      cairo_set_source_rgba(gc, 0.0, 0.0, 0.0, 1.0);
-      cairo_rectangle(gc, 0, 0, width, height);
+  if(!height || !width)
+    return;
+
+  int prev_phase = stats_phase(pt, PHASE_BLIT);
+
+  int buffer_width  = pt->cols * pt->cell_width;
+  int buffer_height = pt->rows * pt->cell_height;
+
+  {
+    // TODO: "bleed" out the edge of the backing buffer instead
+    GdkRGBA black = { 0.0, 0.0, 0.0, 1.0 };
+    graphene_rect_t border[] = {
+      GRAPHENE_RECT_INIT(0, 0, width, CONF_border),
+      GRAPHENE_RECT_INIT(0, CONF_border + buffer_height, width, height - CONF_border - buffer_height),
+      GRAPHENE_RECT_INIT(0, CONF_border, CONF_border, buffer_height),
+      GRAPHENE_RECT_INIT(CONF_border + buffer_width, CONF_border, width - CONF_border - buffer_width, buffer_height),
+    };
+
+    for(int i = 0; i < 4; i++)
+      if(border[i].size.width > 0 && border[i].size.height > 0)
+        gtk_snapshot_append_color(snapshot, &black, &border[i]);
+  }
+
+  GdkRectangle scrollbar_area;
+  bool scrollbar = get_scrollbar_area(pt, width, &scrollbar_area);
+  graphene_rect_t scrollbar_bounds;
+
+  if(scrollbar) {
+    graphene_rect_init(&scrollbar_bounds,
+        scrollbar_area.x, scrollbar_area.y, scrollbar_area.width, scrollbar_area.height);
+
+    cairo_t *gc = gtk_snapshot_append_cairo(snapshot, &scrollbar_bounds);
+    erase_scrollbar(pt, gc, &scrollbar_area);
+    cairo_destroy(gc);
+  }
+
+  GdkRectangle selection[pt->rows];
+  int n_selection = selection_rects(pt, selection);
+
+  /* The selection inverts whatever is under it */
+  if(n_selection)
+    gtk_snapshot_push_blend(snapshot, GSK_BLEND_MODE_DIFFERENCE);
+
+  /* Rows keep their node until damaged, so GTK can reuse what it drew of them
+   * last frame */
+  for(int row = 0; row < pt->n_dirty_rows; row++) {
+    if(!pt->row_nodes[row])
+      pt->row_nodes[row] = row_node_new(pt, row);
+
+    gtk_snapshot_save(snapshot);
+    gtk_snapshot_translate(snapshot,
+        &GRAPHENE_POINT_INIT(CONF_border, CONF_border + row * pt->cell_height));
+    gtk_snapshot_append_node(snapshot, pt->row_nodes[row]);
+    gtk_snapshot_restore(snapshot);
+  }
+
+  if(n_selection) {
+    gtk_snapshot_pop(snapshot);
+
+    GdkRGBA white = { 1.0, 1.0, 1.0, 1.0 };
+    for(int i = 0; i < n_selection; i++)
+      gtk_snapshot_append_color(snapshot, &white,
+          &GRAPHENE_RECT_INIT(CONF_border + selection[i].x, CONF_border + selection[i].y,
+                              selection[i].width, selection[i].height));
+
+    gtk_snapshot_pop(snapshot);
+  }
+
+  GdkRectangle cursor;
+  VTermScreenCell cursor_cell;
+  if(cursor_area(pt, &cursor, &cursor_cell)) {
+    cairo_t *gc = gtk_snapshot_append_cairo(snapshot,
+        &GRAPHENE_RECT_INIT(CONF_border + cursor.x, CONF_border + cursor.y, cursor.width, cursor.height));
+    cairo_translate(gc, CONF_border, CONF_border);
+    draw_cursor(pt, gc, &cursor, &cursor_cell);
+    cairo_destroy(gc);
+  }
+
+  if(scrollbar && pt->scroll_offs) {
+    cairo_t *gc = gtk_snapshot_append_cairo(snapshot, &scrollbar_bounds);
+    draw_scrollbar(pt, gc, &scrollbar_area);
+    cairo_destroy(gc);
+  }
+
+#ifdef DEBUG_SHOW_LINECONTINUATION
+  {
+    cairo_t *gc = gtk_snapshot_append_cairo(snapshot,
+        &GRAPHENE_RECT_INIT(0, 0, width, height));
+    draw_linecontinuation(pt, gc);
+    cairo_destroy(gc);
+  }
+#endif
+
+  stats_phase(pt, prev_phase);
+}
+
+/* Image surfaces, because rows are handed to GTK as textures of their pixels,
+ * at the widget's scale factor. Strips that are still the right size are kept
+ * as they are; the others are copied over as far as they go */
+static void create_buffer(PangoTerm *pt)
+{
+  int scale = pt->buffer_scale;
+  int width = pt->cols * pt->cell_width;
+
+  for(int row = pt->rows; row < pt->n_buffer_rows; row++)
+    cairo_surface_destroy(pt->buffer[row]);
+
+  pt->buffer = g_renew(cairo_surface_t *, pt->buffer, pt->rows);
+
+  for(int row = 0; row < pt->rows; row++) {
+    cairo_surface_t *old = row < pt->n_buffer_rows ? pt->buffer[row] : NULL;
+
+    if(old &&
+        cairo_image_surface_get_width(old)  == width * scale &&
+        cairo_image_surface_get_height(old) == pt->cell_height * scale)
+      continue;
+
+    pt->buffer[row] = cairo_image_surface_create(CAIRO_FORMAT_RGB24,
+        width * scale, pt->cell_height * scale);
+    cairo_surface_set_device_scale(pt->buffer[row], scale, scale);
+
+    if(old) {
+      cairo_t* gc = cairo_create(pt->buffer[row]);
+      cairo_set_source_surface(gc, old, 0, 0);
       cairo_paint(gc);
-      cairo_restore(gc);
+      cairo_destroy(gc);
+
+      cairo_surface_destroy(old);
     }
-    blit_buffer(pt, gc, width, height);
   }
 
-  return;
+  pt->n_buffer_rows = pt->rows;
 }
 
-static void widget_resize(GtkDrawingArea *da, gint width, gint height, gpointer user_data)
+/* Reallocate the buffer for the current size, keeping what it can */
+static void resize_buffer(PangoTerm *pt)
 {
-  PangoTerm *pt = user_data;
+  create_buffer(pt);
 
+  shadow_resize(pt);
+  dirty_rows_resize(pt);
+  damage_resize(pt);
+
+  if(pt->headless_target) {
+    cairo_surface_destroy(pt->headless_target);
+    pt->headless_target = cairo_image_surface_create(CAIRO_FORMAT_RGB24,
+        pt->cols * pt->cell_width  + 2 * CONF_border,
+        pt->rows * pt->cell_height + 2 * CONF_border);
+  }
+}
+
+static void widget_resize(PangoTerm *pt, gint width, gint height)
+{
   gint raw_width, raw_height;
   // TODO: gdk_surface_get_scale_factor() (except that we don't use it)
   raw_width = width;
@@ -2187,18 +4861,8 @@ static void widget_resize(GtkDrawingArea *da, gint width, gint height, gpointer
   if(pt->resizedfn)
     (*pt->resizedfn)(pt->rows, pt->cols, pt->resizedfn_data);
 
-  cairo_surface_t* new_buffer = gdk_surface_create_similar_surface(pt->termdraw,
-      CAIRO_CONTENT_COLOR,
-      pt->cols * pt->cell_width,
-      pt->rows * pt->cell_height);
-
-  cairo_t* gc = cairo_create(new_buffer);
-  cairo_set_source_surface(gc, pt->buffer, 0, 0);
-  cairo_paint(gc);
-  cairo_destroy(gc);
+  resize_buffer(pt);
 
-  cairo_surface_destroy(pt->buffer);
-  pt->buffer = new_buffer;
   if (pt->did_set_font_size) {
     pt->did_set_font_size = false;
 
@@ -2216,6 +4880,83 @@ static void widget_resize(GtkDrawingArea *da, gint width, gint height, gpointer
   }
 }
 
+/* The terminal's widget; all it does itself is draw and size */
+#define PANGOTERM_TYPE_AREA (pangoterm_area_get_type())
+G_DECLARE_FINAL_TYPE(PangoTermArea, pangoterm_area, PANGOTERM, AREA, GtkWidget)
+
+struct _PangoTermArea {
+  GtkWidget parent_instance;
+
+  PangoTerm *pt;
+};
+
+G_DEFINE_TYPE(PangoTermArea, pangoterm_area, GTK_TYPE_WIDGET)
+
+static void pangoterm_area_snapshot(GtkWidget *widget, GtkSnapshot *snapshot)
+{
+  PangoTermArea *area = PANGOTERM_AREA(widget);
+
+  widget_snapshot(area->pt, snapshot,
+      gtk_widget_get_width(widget), gtk_widget_get_height(widget));
+}
+
+static void pangoterm_area_size_allocate(GtkWidget *widget, int width, int height, int baseline)
+{
+  PangoTermArea *area = PANGOTERM_AREA(widget);
+
+  widget_resize(area->pt, width, height);
+}
+
+static void pangoterm_area_init(PangoTermArea *area)
+{
+}
+
+static void pangoterm_area_class_init(PangoTermAreaClass *klass)
+{
+  GtkWidgetClass *widget_class = GTK_WIDGET_CLASS(klass);
+
+  widget_class->snapshot      = pangoterm_area_snapshot;
+  widget_class->size_allocate = pangoterm_area_size_allocate;
+}
+
+static GtkWidget *pangoterm_area_new(PangoTerm *pt)
+{
+  PangoTermArea *area = g_object_new(PANGOTERM_TYPE_AREA, NULL);
+  area->pt = pt;
+
+  return GTK_WIDGET(area);
+}
+
+static void widget_scale_changed(GObject *object, GParamSpec *pspec, gpointer user_data)
+{
+  PangoTerm *pt = user_data;
+
+  int scale = gtk_widget_get_scale_factor(pt->termda);
+  if(!pt->buffer || scale == pt->buffer_scale)
+    return;
+
+  flush_pending(pt);
+
+  /* Every strip is reallocated, and the old pixels are only a stretched
+   * stand-in; paint everything again at the new scale */
+  pt->buffer_scale = scale;
+  create_buffer(pt);
+  if(pt->atlas.surface)
+    glyph_atlas_reset(pt);
+  dirty_rows_resize(pt);
+  shadow_invalidate(pt);
+
+  repaint_phyrect(pt, (PhyRect){
+      .start_prow = 0,
+      .end_prow   = pt->rows,
+      .start_pcol = 0,
+      .end_pcol   = pt->cols,
+  });
+
+  flush_pending(pt);
+  blit_dirty(pt);
+}
+
 static void widget_focus_in(GtkWidget *widget, gpointer user_data)
 {
   PangoTerm *pt = user_data;
@@ -2225,12 +4966,8 @@ static void widget_focus_in(GtkWidget *widget, gpointer user_data)
   VTermState *state = vterm_obtain_state(pt->vt);
   vterm_state_focus_in(state);
 
-  if(CURSOR_ENABLED(pt)) {
-    repaint_cell(pt, pt->cursorpos);
-
-    flush_pending(pt);
-    blit_dirty(pt);
-  }
+  cursor_changed(pt);
+  blit_dirty(pt);
 
   if (pt->ibuscontext) {
     ibus_input_context_focus_in (pt->ibuscontext);
@@ -2246,12 +4983,8 @@ static void widget_focus_out(GtkWidget *widget, gpointer user_data)
   VTermState *state = vterm_obtain_state(pt->vt);
   vterm_state_focus_out(state);
 
-  if(CURSOR_ENABLED(pt)) {
-    repaint_cell(pt, pt->cursorpos);
-
-    flush_pending(pt);
-    blit_dirty(pt);
-  }
+  cursor_changed(pt);
+  blit_dirty(pt);
   if (pt->ibuscontext) {
     ibus_input_context_focus_out (pt->ibuscontext);
   }
@@ -2304,7 +5037,8 @@ static GdkPixbuf *load_icon(GdkRGBA *background)
   return ret;
 }
 
-PangoTerm *pangoterm_new(int rows, int cols)
+/* Everything that doesn't need a widget */
+static PangoTerm *pangoterm_new_common(int rows, int cols)
 {
   PangoTerm *pt = g_new0(PangoTerm, 1);
 
@@ -2345,6 +5079,72 @@ PangoTerm *pangoterm_new(int rows, int cols)
   vterm_screen_set_callbacks(pt->vts, &cb, pt);
   vterm_screen_set_damage_merge(pt->vts, VTERM_DAMAGE_SCROLL);
 
+  pt->glyphs = g_string_sized_new(128);
+  pt->glyph_widths = g_array_new(FALSE, FALSE, sizeof(int));
+  pt->atlas_pending = g_ptr_array_new();
+  pt->run_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, shaped_run_free);
+  pt->run_cache_key = g_string_new(NULL);
+
+  pt->pen.key = STYLE_KEY_NONE;
+  pt->shadow.last_key = STYLE_KEY_NONE;
+  pt->styles = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, style_free);
+  pt->styles_by_id = g_ptr_array_new();
+
+  pt->cursor_shape = VTERM_PROP_CURSORSHAPE_BLOCK;
+
+  pt->dragging = NO_DRAG;
+
+  pt->scroll_size = CONF_scrollback_size;
+  pt->sb_capacity = pt->scroll_size;
+
+  pt->sb_spill_fd = -1;
+  pt->sb_spill_index_fd = -1;
+
+  if(CONF_scrollback_file && CONF_scrollback_file[0] && pt->sb_capacity) {
+    pt->sb_spill_fd       = sb_spill_open_file(CONF_scrollback_file);
+    pt->sb_spill_index_fd = sb_spill_open_file(CONF_scrollback_file);
+
+    if(pt->sb_spill_fd == -1 || pt->sb_spill_index_fd == -1) {
+      if(pt->sb_spill_fd != -1)
+        close(pt->sb_spill_fd);
+      if(pt->sb_spill_index_fd != -1)
+        close(pt->sb_spill_index_fd);
+      pt->sb_spill_fd = pt->sb_spill_index_fd = -1;
+    }
+  }
+
+  if(pt->sb_spill_fd != -1) {
+    /* The hot window still applies, but now there's no limit behind it */
+    if(CONF_scrollback_hot > 0 && CONF_scrollback_hot < pt->sb_capacity)
+      pt->sb_capacity = CONF_scrollback_hot;
+
+    pt->sb_spill_wbuf       = g_byte_array_new();
+    pt->sb_spill_wbuf_index = g_array_new(FALSE, FALSE, sizeof(guint64));
+  }
+  else if(CONF_scrollback_hot > 0 && CONF_scrollback_hot < pt->scroll_size) {
+    pt->sb_capacity = CONF_scrollback_hot;
+
+    pt->sb_cold_pending = g_ptr_array_new();
+    pt->sb_cold_blocks  = g_ptr_array_new();
+    pt->sb_compressor   = G_CONVERTER(g_zlib_compressor_new(G_ZLIB_COMPRESSOR_FORMAT_RAW, 1));
+    pt->sb_decompressor = G_CONVERTER(g_zlib_decompressor_new(G_ZLIB_COMPRESSOR_FORMAT_RAW));
+    pt->sb_cold_cache   = g_byte_array_new();
+  }
+
+  pt->sb_buffer = g_new0(PangoTermScrollbackLine*, pt->sb_capacity);
+
+  pt->outbuffer = g_string_sized_new(256);
+  pt->tmpbuffer = g_string_sized_new(256);
+
+  vterm_output_set_callback(pt->vt, term_output, pt);
+
+  return pt;
+}
+
+PangoTerm *pangoterm_new(int rows, int cols)
+{
+  PangoTerm *pt = pangoterm_new_common(rows, cols);
+
   /* Set up GTK widget */
 
   pt->termwin = gtk_window_new();
@@ -2353,10 +5153,7 @@ PangoTerm *pangoterm_new(int rows, int cols)
   // HOW
   // gtk_widget_(pt->termwin, GTK_STATE_NORMAL, &pt->bg_col);
 
-  pt->glyphs = g_string_sized_new(128);
-  pt->glyph_widths = g_array_new(FALSE, FALSE, sizeof(int));
-
-  pt->termda = gtk_drawing_area_new();
+  pt->termda = pangoterm_area_new(pt);
   gtk_window_set_child (GTK_WINDOW (pt->termwin), pt->termda);
 
   gtk_widget_realize(pt->termwin);
@@ -2368,7 +5165,6 @@ PangoTerm *pangoterm_new(int rows, int cols)
   // gdk_window_set_cursor(pt->termdraw, gdk_cursor_new(GDK_XTERM));
 
   cursor_start_blinking(pt);
-  pt->cursor_shape = VTERM_PROP_CURSORSHAPE_BLOCK;
 
   //GdkEventMask mask = gdk_window_get_events(pt->termdraw);
   //gdk_window_set_events(pt->termdraw, mask|GDK_BUTTON_PRESS_MASK|GDK_BUTTON_RELEASE_MASK|GDK_POINTER_MOTION_MASK|GDK_SCROLL_MASK);
@@ -2386,8 +5182,6 @@ PangoTerm *pangoterm_new(int rows, int cols)
   GtkEventController *scroll_ev = gtk_event_controller_scroll_new(GTK_EVENT_CONTROLLER_SCROLL_BOTH_AXES);
   gtk_widget_add_controller(pt->termda, scroll_ev);
 
-  gtk_drawing_area_set_draw_func(GTK_DRAWING_AREA(pt->termda), widget_draw, pt, NULL);
-
   g_signal_connect(G_OBJECT(key_ev), "key-pressed", G_CALLBACK(widget_keypress), pt);
   g_signal_connect(G_OBJECT(key_ev), "key-released", G_CALLBACK(widget_keyrelease), pt);
   // g_signal_connect(G_OBJECT(key_ev), "modifiers", G_CALLBACK(widget_modifiers), pt);
@@ -2397,6 +5191,7 @@ PangoTerm *pangoterm_new(int rows, int cols)
   g_signal_connect(G_OBJECT(scroll_ev), "scroll",  G_CALLBACK(widget_scroll), pt);
   g_signal_connect(G_OBJECT(focus_ev), "enter",  G_CALLBACK(widget_focus_in),  pt);
   g_signal_connect(G_OBJECT(focus_ev), "leave", G_CALLBACK(widget_focus_out), pt);
+  g_signal_connect(G_OBJECT(pt->termda), "notify::scale-factor", G_CALLBACK(widget_scale_changed), pt);
 
   gtk_widget_set_focusable(pt->termda, true);
 
@@ -2416,29 +5211,60 @@ PangoTerm *pangoterm_new(int rows, int cols)
 
   ibus_connect_try(pt); // async
 
-  g_signal_connect(G_OBJECT(pt->termda), "resize", G_CALLBACK(widget_resize), pt);
-
-  pt->dragging = NO_DRAG;
-
   // TODO: GRUGG
   GdkDisplay *display = gdk_display_get_default();
   pt->selection_primary   = gdk_display_get_primary_clipboard(display);
   pt->selection_clipboard = gdk_display_get_clipboard(display);
 
-  pt->scroll_size = CONF_scrollback_size;
-  pt->sb_buffer = g_new0(PangoTermScrollbackLine*, pt->scroll_size);
-
-  pt->outbuffer = g_string_sized_new(256);
-  pt->tmpbuffer = g_string_sized_new(256);
-
-  vterm_output_set_callback(pt->vt, term_output, pt);
-
   return pt;
 }
 
+/* A terminal with no window, rendering into an image surface. Frames are only
+ * drawn when the caller asks with pangoterm_render_frame() */
+PangoTerm *pangoterm_new_headless(int rows, int cols)
+{
+  return pangoterm_new_common(rows, cols);
+}
+
 void pangoterm_free(PangoTerm *pt)
 {
   g_strfreev(pt->fonts);
+  g_free(pt->font_italic);
+
+  for(int row = 0; row < pt->n_buffer_rows; row++)
+    cairo_surface_destroy(pt->buffer[row]);
+  g_free(pt->buffer);
+
+  if(pt->headless_target)
+    cairo_surface_destroy(pt->headless_target);
+
+  for(int row = 0; row < pt->n_dirty_rows; row++)
+    g_clear_pointer(&pt->row_nodes[row], gsk_render_node_unref);
+  g_free(pt->row_nodes);
+  g_free(pt->dirty_rows);
+  g_free(pt->damage_rows);
+  g_free(pt->selection_drawn);
+
+  glyph_atlas_free(pt);
+  ascii_glyphs_free(pt);
+  g_free(pt->ascii_pending);
+
+  g_string_free(pt->glyphs, TRUE);
+  g_array_free(pt->glyph_widths, TRUE);
+  g_ptr_array_free(pt->atlas_pending, TRUE);
+  g_hash_table_destroy(pt->run_cache);
+  g_string_free(pt->run_cache_key, TRUE);
+
+  g_clear_object(&pt->pen.layout);
+  g_ptr_array_free(pt->styles_by_id, TRUE);
+  g_hash_table_destroy(pt->styles);
+
+  shadow_free(pt);
+  raster_free(pt);
+  sb_free(pt);
+
+  g_string_free(pt->outbuffer, TRUE);
+  g_string_free(pt->tmpbuffer, TRUE);
 
   vterm_free(pt->vt);
 }
@@ -2506,6 +5332,28 @@ void pangoterm_set_font_size(PangoTerm *pt, double size)
   pt->font_size = size;
 }
 
+/* Resize the terminal itself, as if the window had been resized to fit. The
+ * window follows if there is one */
+void pangoterm_set_size(PangoTerm *pt, int rows, int cols)
+{
+  if(rows == pt->rows && cols == pt->cols)
+    return;
+
+  pt->rows = rows;
+  pt->cols = cols;
+
+  if(pt->buffer)
+    resize_buffer(pt);
+
+  vterm_set_size(pt->vt, rows, cols);
+  vterm_screen_flush_damage(pt->vts);
+
+  if(pt->termwin)
+    gtk_window_set_default_size(GTK_WINDOW(pt->termwin),
+        cols * pt->cell_width  + 2 * CONF_border,
+        rows * pt->cell_height + 2 * CONF_border);
+}
+
 void pangoterm_set_title(PangoTerm *pt, const char *title)
 {
   gtk_window_set_title(GTK_WINDOW(pt->termwin), title);
@@ -2525,7 +5373,7 @@ void pangoterm_set_resized_fn(PangoTerm *pt, PangoTermResizedFn *fn, void *user)
 
 void pangoterm_init_font(PangoTerm *pt) {
   // cairo_t *cctx = gdk_cairo_create(pt->termdraw);
-  cairo_t *cctx = cairo_create(pt->buffer);
+  cairo_t *cctx = cairo_create(pt->buffer ? pt->buffer[0] : NULL);
   PangoContext *pctx = pango_cairo_create_context(cctx);
 
   PangoFontDescription *fontdesc = pango_font_description_from_string(pt->fonts[0]);
@@ -2538,7 +5386,6 @@ void pangoterm_init_font(PangoTerm *pt) {
   // TODO: så jävla BULL
   pango_cairo_context_set_resolution(pctx, 100);
 
-  pt->pen.pangoattrs = pango_attr_list_new();
   pt->pen.layout = pango_layout_new(pctx);
   pango_layout_set_font_description(pt->pen.layout, fontdesc);
 
@@ -2553,6 +5400,19 @@ void pangoterm_init_font(PangoTerm *pt) {
   pt->cell_width  = PANGO_PIXELS_CEIL(width);
   pt->cell_width_pango = PANGO_SCALE*pt->cell_width;
   pt->cell_height = PANGO_PIXELS_CEIL(height);
+
+  glyph_atlas_init(pt, pctx, fontdesc);
+  ascii_glyphs_init(pt, pctx, fontdesc);
+
+  if(pt->raster.fontdesc)
+    pango_font_description_free(pt->raster.fontdesc);
+  pt->raster.fontdesc = pango_font_description_copy(fontdesc);
+  pt->raster.font_serial++;
+
+  /* Shaped at the old size */
+  g_hash_table_remove_all(pt->run_cache);
+
+  shadow_invalidate(pt);
 }
 
 void pangoterm_set_fontsize(PangoTerm* pt, double font_size) {
@@ -2567,6 +5427,8 @@ void pangoterm_start(PangoTerm *pt)
 {
   /* Finish the rest of the setup and start */
 
+  /* The glyph atlas is made at this scale too */
+  pt->buffer_scale = pt->termda ? gtk_widget_get_scale_factor(pt->termda) : 1;
 
   pangoterm_init_font(pt);
 
@@ -2578,14 +5440,30 @@ void pangoterm_start(PangoTerm *pt)
 
   pangoterm_set_default_colors(pt, &fg_col, &bg_col);
 
+  shadow_resize(pt);
+  dirty_rows_resize(pt);
+  damage_resize(pt);
+
+  pt->raster.n_threads = CONF_render_threads ? CONF_render_threads : g_get_num_processors();
+
+  if(!pt->termwin) {
+    create_buffer(pt);
+    pt->headless_target = cairo_image_surface_create(CAIRO_FORMAT_RGB24,
+        pt->cols * pt->cell_width  + 2 * CONF_border,
+        pt->rows * pt->cell_height + 2 * CONF_border);
+
+    vterm_screen_reset(pt->vts, 1);
+
+    VTermState *state = vterm_obtain_state(pt->vt);
+    vterm_state_set_termprop(state, VTERM_PROP_CURSORSHAPE, &(VTermValue){ .number = CONF_cursor_shape });
+    return;
+  }
+
   gtk_window_set_default_size(GTK_WINDOW(pt->termwin),
       pt->cols * pt->cell_width  + 2 * CONF_border,
       pt->rows * pt->cell_height + 2 * CONF_border);
 
-  pt->buffer = gdk_surface_create_similar_surface(pt->termdraw,
-      CAIRO_CONTENT_COLOR,
-      pt->cols * pt->cell_width,
-      pt->rows * pt->cell_height);
+  create_buffer(pt);
 
   // GdkGeometry hints;
 
@@ -2614,25 +5492,127 @@ void pangoterm_push_bytes(PangoTerm *pt, const char *bytes, size_t len)
   if(CONF_unscroll_on_output && pt->scroll_offs)
     vscroll_delta(pt, -pt->scroll_offs);
 
+  int prev_phase = stats_phase(pt, PHASE_PARSE);
   vterm_input_write(pt->vt, bytes, len);
+  stats_phase(pt, prev_phase);
+
+  pt->stats.bytes += len;
 }
 
 void pangoterm_begin_update(PangoTerm *pt)
 {
-  /* Hide cursor during damage flush */
-
-  pt->cursor_hidden_for_redraw = 1;
-  repaint_cell(pt, pt->cursorpos);
+  /* Nothing to hide; the cursor is never drawn into the buffer */
 }
 
-void pangoterm_end_update(PangoTerm *pt)
+void pangoterm_render_frame(PangoTerm *pt)
 {
-  vterm_screen_flush_damage(pt->vts);
+  pt->frame_pending = false;
 
-  pt->cursor_hidden_for_redraw = 0;
-  repaint_cell(pt, pt->cursorpos);
+  vterm_screen_flush_damage(pt->vts);
+  damage_flush(pt);
 
   flush_pending(pt);
   blit_dirty(pt);
+
+  GdkRectangle cursor;
+  VTermScreenCell cursor_cell;
+  if(cursor_area(pt, &cursor, &cursor_cell))
+    pt_ibus_set_cursor_location(pt, cursor);
+
+  pt->stats.frames++;
+
+#ifdef DEBUG_ALLOC_COUNT
+  /* A cache miss is allowed to allocate; nothing else in the repaint path is.
+   * Only checked headless, as GTK allocates freely while snapshotting */
+  guint64 misses = pt->stats.atlas_misses + pt->stats.run_misses;
+  if(pt->collect_stats && pt->headless_target &&
+      alloc_count != pt->stats.frame_allocs_base &&
+      misses == pt->stats.frame_misses_base) {
+    fprintf(stderr, "ARGH! %" G_GUINT64_FORMAT " allocations repainting frame %" G_GUINT64_FORMAT " with no cache misses\n",
+        alloc_count - pt->stats.frame_allocs_base, pt->stats.frames);
+    abort();
+  }
+  pt->stats.frame_allocs_base = alloc_count;
+  pt->stats.frame_misses_base = misses;
+#endif
+}
+
+static gboolean frame_tick(GtkWidget *widget, GdkFrameClock *clock, gpointer user_data)
+{
+  PangoTerm *pt = user_data;
+
+  pt->frame_tick_id = 0;
+  pangoterm_render_frame(pt);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Rasterize at most once per frame, however much input arrived */
+static void schedule_frame(PangoTerm *pt)
+{
+  if(!pt->termda)
+    pt->frame_pending = true;
+  else if(!pt->frame_tick_id)
+    pt->frame_tick_id = gtk_widget_add_tick_callback(pt->termda, frame_tick, pt, NULL);
+}
+
+void pangoterm_end_update(PangoTerm *pt)
+{
+  /* Replies to the application shouldn't wait for the display */
   flush_outbuffer(pt);
+
+  schedule_frame(pt);
+}
+
+gboolean pangoterm_frame_pending(PangoTerm *pt)
+{
+  return pt->frame_pending || pt->frame_tick_id;
+}
+
+void pangoterm_set_collect_stats(PangoTerm *pt, gboolean collect)
+{
+  if(collect && !pt->collect_stats) {
+    pt->stats.phase = PHASE_OTHER;
+    pt->stats.phase_start = g_get_monotonic_time();
+  }
+
+  pt->collect_stats = collect;
+}
+
+void pangoterm_print_stats(PangoTerm *pt, FILE *out)
+{
+  static const char *phase_names[PHASE_COUNT] = {
+    [PHASE_OTHER]  = "other",
+    [PHASE_PARSE]  = "parse",
+    [PHASE_DAMAGE] = "damage",
+    [PHASE_FLUSH]  = "flush_pending",
+    [PHASE_BLIT]   = "blit",
+  };
+
+  /* Account the time up to now against whatever is running */
+  stats_phase(pt, pt->stats.phase);
+
+  fprintf(out, "render: %" G_GUINT64_FORMAT " bytes parsed, %" G_GUINT64_FORMAT " frames\n",
+      pt->stats.bytes, pt->stats.frames);
+
+  fprintf(out, "render: glyph atlas %" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT " misses, %" G_GUINT64_FORMAT " resets\n",
+      pt->stats.atlas_hits, pt->stats.atlas_misses, pt->stats.atlas_resets);
+
+  fprintf(out, "render: shaped runs %" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT " misses\n",
+      pt->stats.run_hits, pt->stats.run_misses);
+
+#ifdef DEBUG_ALLOC_COUNT
+  fprintf(out, "render: %" G_GUINT64_FORMAT " allocations while repainting\n",
+      alloc_count);
+#endif
+
+  if(pt->stats.phase_time[PHASE_PARSE])
+    fprintf(out, "render: parse %.2f MB/s\n",
+        (double)pt->stats.bytes / pt->stats.phase_time[PHASE_PARSE]);
+
+  for(int phase = PHASE_PARSE; phase < PHASE_COUNT; phase++)
+    fprintf(out, "render: %-13s %10.3f ms total, %8.3f ms/frame\n",
+        phase_names[phase],
+        pt->stats.phase_time[phase] / 1000.0,
+        pt->stats.frames ? pt->stats.phase_time[phase] / 1000.0 / pt->stats.frames : 0.0);
 }
@@ -9,6 +9,7 @@
 typedef struct PangoTerm PangoTerm;
 
 PangoTerm *pangoterm_new(int rows, int cols);
+PangoTerm *pangoterm_new_headless(int rows, int cols);
 void pangoterm_free(PangoTerm *pt);
 
 guint32 pangoterm_get_windowid(PangoTerm *pt);
@@ -19,12 +20,20 @@ void pangoterm_set_fonts(PangoTerm *pt, char *font, char *font_italic, char **al
 
 void pangoterm_set_title(PangoTerm *pt, const char *title);
 
+void pangoterm_set_size(PangoTerm *pt, int rows, int cols);
+
 void pangoterm_start(PangoTerm *pt);
 
 void pangoterm_begin_update(PangoTerm *pt);
 void pangoterm_push_bytes(PangoTerm *pt, const char *bytes, size_t len);
 void pangoterm_end_update(PangoTerm *pt);
 
+gboolean pangoterm_frame_pending(PangoTerm *pt);
+void pangoterm_render_frame(PangoTerm *pt);
+
+void pangoterm_set_collect_stats(PangoTerm *pt, gboolean collect);
+void pangoterm_print_stats(PangoTerm *pt, FILE *out);
+
 typedef size_t PangoTermWriteFn(const char *bytes, size_t len, void *user);
 void pangoterm_set_write_fn(PangoTerm *pt, PangoTermWriteFn *fn, void *user);
 
@@ -0,0 +1,85 @@
+/* Checks buffer_copy_rect() against a plain copy of the whole buffer, for
+ * overlapping moves in each direction and at more than one scale */
+
+#include "../pangoterm.c"
+
+#define ROWS 6
+#define COLS 10
+
+static int failures;
+
+static guint32 *pixel_at(PangoTerm *pt, int x, int y)
+{
+  cairo_surface_t *strip = pt->buffer[y / (pt->cell_height * pt->buffer_scale)];
+  int stride = cairo_image_surface_get_stride(strip);
+
+  return (guint32 *)(cairo_image_surface_get_data(strip) +
+      (y % (pt->cell_height * pt->buffer_scale)) * stride) + x;
+}
+
+static void check_move(int scale, PhyRect dest, int drow, int dcol)
+{
+  PangoTerm *pt = g_new0(PangoTerm, 1);
+  pt->rows = ROWS;
+  pt->cols = COLS;
+  pt->cell_width  = 3;
+  pt->cell_height = 2;
+  pt->buffer_scale = scale;
+
+  create_buffer(pt);
+
+  int width  = COLS * pt->cell_width  * scale;
+  int height = ROWS * pt->cell_height * scale;
+  int cell_width  = pt->cell_width  * scale;
+  int cell_height = pt->cell_height * scale;
+
+  /* Every pixel different, so any misplaced one shows */
+  guint32 *expect = g_new(guint32, width * height);
+  for(int y = 0; y < height; y++)
+    for(int x = 0; x < width; x++)
+      *pixel_at(pt, x, y) = expect[y * width + x] = 0xff000000 | y << 12 | x;
+
+  guint32 *before = g_memdup2(expect, width * height * sizeof(guint32));
+  for(int y = dest.start_prow * cell_height; y < dest.end_prow * cell_height; y++)
+    for(int x = dest.start_pcol * cell_width; x < dest.end_pcol * cell_width; x++)
+      expect[y * width + x] = before[(y - drow * cell_height) * width + x - dcol * cell_width];
+
+  buffer_copy_rect(pt, dest, drow, dcol);
+
+  for(int y = 0; y < height; y++)
+    for(int x = 0; x < width; x++)
+      if(*pixel_at(pt, x, y) != expect[y * width + x]) {
+        fprintf(stderr, "FAIL scale %d move (%d,%d): pixel (%d,%d) is %08x, expected %08x\n",
+            scale, drow, dcol, x, y, *pixel_at(pt, x, y), expect[y * width + x]);
+        failures++;
+        goto done;
+      }
+
+done:
+  for(int row = 0; row < pt->n_buffer_rows; row++)
+    cairo_surface_destroy(pt->buffer[row]);
+  g_free(pt->buffer);
+  g_free(before);
+  g_free(expect);
+  g_free(pt);
+}
+
+int main(int argc, char *argv[])
+{
+  PhyRect dest = { .start_prow = 1, .end_prow = 5, .start_pcol = 2, .end_pcol = 8 };
+
+  for(int scale = 1; scale <= 2; scale++) {
+    check_move(scale, dest,  1,  0); /* down */
+    check_move(scale, dest, -1,  0); /* up */
+    check_move(scale, dest,  0,  1); /* right */
+    check_move(scale, dest,  0, -1); /* left */
+    check_move(scale, dest,  1, -1);
+    check_move(scale, dest, -1,  2);
+  }
+
+  if(failures)
+    return 1;
+
+  printf("ok\n");
+  return 0;
+}